@@ -37,10 +37,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/queue.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <setjmp.h>
 #include <stdarg.h>
 #include <ctype.h>
@@ -48,6 +50,16 @@
 #include <getopt.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include <time.h>
+#include <fcntl.h>
 
 /*
  * RTE_LIBRTE_RING_DEBUG generates statistics of ring buffers. However, SEGV is occurred. (v16.07）
@@ -64,6 +76,7 @@
 #include <rte_launch.h>
 #include <rte_atomic.h>
 #include <rte_cycles.h>
+#include <rte_pause.h>
 #include <rte_prefetch.h>
 #include <rte_lcore.h>
 #include <rte_per_lcore.h>
@@ -75,20 +88,36 @@
 #include <rte_ether.h>
 #include <rte_ethdev.h>
 #include <rte_ring.h>
+#include <rte_eth_ring.h>
+#include <rte_vect.h>
+#include <rte_acl.h>
+#include <rte_ip.h>
+#include <rte_tcp.h>
+#include <rte_udp.h>
+#include <rte_jhash.h>
+#include <rte_byteorder.h>
 #include <rte_mempool.h>
 #include <rte_mbuf.h>
 #include <rte_errno.h>
 #include <rte_timer.h>
 #include <rte_string_fns.h>
 
+struct demu_rand;
+struct demu_bq;
+struct demu_link_params;
+struct demu_link_rxq;
 static int64_t loss_random(const char *loss_rate);
 static int64_t loss_random_a(double loss_rate);
-static bool loss_event(void);
-static bool loss_event_random(uint64_t loss_rate);
-static bool loss_event_GE(uint64_t loss_rate_n, uint64_t loss_rate_a, uint64_t st_ch_rate_no2ab, uint64_t st_ch_rate_ab2no);
-static bool loss_event_4state( uint64_t p13, uint64_t p14, uint64_t p23, uint64_t p31, uint64_t p32);
-static bool dup_event(void);
-#define RANDOM_MAX 1000000000
+static bool loss_event(struct demu_rand *rs, const struct demu_link_params *p, struct demu_link_rxq *st);
+static bool loss_event_random(struct demu_rand *rs, uint64_t loss_rate);
+static bool loss_event_GE(struct demu_rand *rs, bool *state, uint64_t loss_rate_n, uint64_t loss_rate_a, uint64_t st_ch_rate_no2ab, uint64_t st_ch_rate_ab2no);
+static bool loss_event_4state(struct demu_rand *rs, char *state, uint64_t p13, uint64_t p14, uint64_t p23, uint64_t p31, uint64_t p32);
+static bool dup_event(struct demu_rand *rs, uint64_t dup_rate);
+/*
+ * Random numbers are uniform in [0, RANDOM_MAX), and probabilities are
+ * scaled to RANDOM_MAX, so "rnd < p" happens with probability p exactly.
+ */
+#define RANDOM_MAX (1ULL << 32)
 
 static volatile bool force_quit;
 
@@ -105,21 +134,72 @@ static uint16_t nb_txd = RTE_TEST_TX_DESC_DEFAULT;
 /* ethernet addresses of ports */
 static struct ether_addr demu_ports_eth_addr[RTE_MAX_ETHPORTS];
 
-struct rte_mempool * demu_pktmbuf_pool = NULL;
+/*
+ * Pools of each NUMA node: the MTU pool feeds the NIC RX queues and holds
+ * the packets that are not small, and the small pool holds the small
+ * packets while they are delayed and the clones.
+ */
+struct rte_mempool *demu_pktmbuf_pool[RTE_MAX_NUMA_NODES];
+struct rte_mempool *demu_small_pool[RTE_MAX_NUMA_NODES];
 
 static uint32_t demu_enabled_port_mask = 0;
 
-/* Per-port statistics struct */
-struct demu_port_statistics {
-	uint64_t tx;
-	uint64_t rx;
-	uint64_t dropped;
-	uint64_t rx_worker_dropped;
-	uint64_t worker_tx_dropped;
-	uint64_t queue_dropped;
-	uint64_t discarded;
+/*
+ * Per-task statistics (see struct demu_task). Each task only writes its
+ * own cache line, and the counters are summed per port when they are
+ * read. They live in a memzone, so a secondary process can read them at
+ * any rate without touching the data path.
+ */
+struct demu_task_stats {
+	uint64_t rx;			/* received (RX) */
+	uint64_t tx;			/* sent (TX) */
+	uint64_t loss;			/* dropped by the loss model */
+	uint64_t dup;			/* duplicated */
+	uint64_t ring_overflow;		/* dropped because the delay line was full */
+	uint64_t shaping_dropped;	/* dropped by the rate limiter */
+	uint64_t queue_dropped;		/* dropped by the bottleneck queue */
+	uint64_t ecn_marked;		/* marked CE by the bottleneck queue */
+	uint64_t corrupted;		/* bit errors left in the packet */
+	uint64_t tx_retry;		/* NIC TX ring full, burst retried */
+	uint64_t filtered;		/* switched back to the port received on */
+	uint64_t held;			/* released late, the TX ring was full */
+	uint64_t idle_sleeps;		/* sleeps of an idle lcore (first task) */
+	uint64_t idle_late_max;		/* latest wake-up after work was due, TSC */
+	uint64_t cap_missed;		/* not captured, the ring to the writer was full */
+	uint16_t portid;		/* port received on (RX) or sent out of (TX) */
+	bool used;
+} __rte_cache_aligned;
+
+/*
+ * Delay accuracy: a log-linear (HDR) histogram of how late each packet
+ * is sent compared to its deadline, i.e. achieved minus target delay,
+ * recorded by the TX lcores. Values below 2^DEMU_HIST_SUB_BITS cycles
+ * have their own bucket; above, each power of two is split into
+ * 2^DEMU_HIST_SUB_BITS buckets, so a bucket is within 3% of its values.
+ */
+#define DEMU_HIST_SUB_BITS 5
+#define DEMU_HIST_SUB_COUNT (1 << DEMU_HIST_SUB_BITS)
+#define DEMU_HIST_BUCKETS ((64 - DEMU_HIST_SUB_BITS + 1) * DEMU_HIST_SUB_COUNT)
+
+struct demu_hist {
+	uint64_t count[DEMU_HIST_BUCKETS];
+	uint64_t max;			/* TSC cycles */
+	uint64_t early;			/* sent before the deadline */
+	uint16_t portid;		/* port the direction is received on */
+	bool used;
 } __rte_cache_aligned;
-struct demu_port_statistics port_statistics[RTE_MAX_ETHPORTS];
+
+#define DEMU_STATS_MZ_NAME "demu_stats"
+
+/* Stages of all the pipelines and the timer */
+#define DEMU_MAX_TASKS 256
+
+struct demu_stats {
+	struct demu_task_stats task[DEMU_MAX_TASKS];
+	struct demu_hist hist[DEMU_MAX_TASKS];
+};
+
+static struct demu_stats *demu_stats;
 
 /*
  * The maximum number of packets which are processed in burst.
@@ -130,40 +210,131 @@ struct demu_port_statistics port_statistics[RTE_MAX_ETHPORTS];
 #define PKT_BURST_WORKER 32768
 
 /*
- * The default mempool size is not enough for bufferijng 64KB of short packets for 1 second.
- * SHORT_PACKET should be enabled in the case of short packet benchmarking.
- * #define SHORT_PACKET
+ * The delay lines and the pools are sized at startup for what each
+ * direction can receive during its longest delay (see demu_buffer_init()).
+ * Frames of up to DEMU_SMALL_PKT_SIZE bytes are copied at RX into mbufs
+ * of a small size class, so that a delay line full of short packets does
+ * not hold MTU-sized buffers.
  */
-#ifdef SHORT_PACKET
-#define DEMU_DELAYED_BUFFER_PKTS 8388608
-#define MEMPOOL_BUF_SIZE 1152
-#else
-#define DEMU_DELAYED_BUFFER_PKTS 4194304
 #define MEMPOOL_BUF_SIZE RTE_MBUF_DEFAULT_BUF_SIZE /* 2048 */
-#endif
+#define DEMU_SMALL_PKT_SIZE 256
+#define DEMU_SMALL_BUF_SIZE (RTE_PKTMBUF_HEADROOM + DEMU_SMALL_PKT_SIZE)
+/* data room of an MTU-sized mbuf, larger frames are received in chains of them */
+#define DEMU_SEG_SIZE (MEMPOOL_BUF_SIZE - RTE_PKTMBUF_HEADROOM)
+#define DEMU_MIN_DELAYED_PKTS 8192
+/* preamble, start of frame delimiter and inter frame gap */
+#define DEMU_WIRE_OVERHEAD 20
+
+/* largest frame received, with the FCS, from --mtu */
+static uint32_t demu_max_frame = ETHER_MAX_LEN;
+
+/* mbufs of the largest frame */
+static inline unsigned
+demu_frame_segs(void)
+{
+	return (demu_max_frame + DEMU_SEG_SIZE - 1) / DEMU_SEG_SIZE;
+}
 
 #define MEMPOOL_CACHE_SIZE 512
 #define DEMU_SEND_BUFFER_SIZE_PKTS 512
 
 
+/*
+ * Each port runs nb_queues independent pipelines (RX queue, worker, TX
+ * queue). RSS spreads flows over the RX queues, and a flow stays in the
+ * same pipeline up to the peer TX queue, so per-flow order is preserved.
+ */
+#define DEMU_MAX_QUEUES 16
+
+struct demu_dq;
+
 struct port_t {
 	uint8_t portid;
-	uint64_t delayed_time;
-	struct rte_ring *rx_to_workers;
-	struct rte_ring *workers_to_tx;
-	struct rte_ring *workers_to_tx_other;
+	unsigned socket;		/* NUMA node of the NIC */
+	struct rte_mempool *small_pool;
+	struct demu_link *link;		/* packets received on this port */
+	struct demu_dq *rx_to_workers[DEMU_MAX_QUEUES];
+	struct demu_dq *workers_to_tx_other[DEMU_MAX_QUEUES];
+	struct demu_wheel *wheel[DEMU_MAX_QUEUES];
+	/*
+	 * TX queue q sends the packets of the pipelines q of the ports at the
+	 * indexes tx_src[], each from its own ring and bottleneck queue.
+	 */
+	uint8_t nb_tx_src;
+	uint8_t tx_src[RTE_MAX_ETHPORTS];
+	struct demu_dq *workers_to_tx[RTE_MAX_ETHPORTS][DEMU_MAX_QUEUES];
+	struct demu_bq *bq[RTE_MAX_ETHPORTS][DEMU_MAX_QUEUES];
+	/*
+	 * When the worker of pipeline q releases next, published for the
+	 * TX lcores it releases to, so that they do not sleep past it.
+	 */
+	struct {
+		uint64_t tsc;
+	} __rte_cache_aligned release_next[DEMU_MAX_QUEUES];
 };
 
 
 enum thread_type_t {
 	RX = 0,
 	TX,
-	WORKER
+	WORKER,
+	TIMER,
+	GEN,
+	CAPTURE
+};
+
+/*
+ * A stage of a pipeline, the timer, the generator or the capture writer.
+ * An lcore runs one or several tasks, polling each of them in turn: a
+ * dedicated lcore per stage, or the three stages of a direction on one
+ * lcore (run to completion).
+ */
+struct demu_task {
+	enum thread_type_t type;
+	uint8_t port_idx;
+	uint16_t queue;
+	unsigned lcore_id;
+	struct demu_task_stats *stats;
+	struct demu_hist *hist;		/* TX */
+	struct demu_worker *worker;	/* WORKER */
+	struct demu_dq *cap;		/* RX and TX, with --capture */
+};
+
+static struct demu_task demu_tasks[DEMU_MAX_TASKS];
+static unsigned demu_nb_tasks;
+
+/* Buffers of the burst a task of an lcore is processing */
+struct demu_scratch {
+	union {
+		struct {
+			struct rte_mbuf *pkts_burst[PKT_BURST_RX];
+			struct rte_mbuf *rx2w_buffer[PKT_BURST_RX];
+			struct rte_mbuf *switched[PKT_BURST_RX];
+			uint64_t rx2w_deadline[PKT_BURST_RX];
+			uint8_t classes[PKT_BURST_RX];
+			uint8_t egress[PKT_BURST_RX];
+			uint16_t corrupt_idx[PKT_BURST_RX];
+			bool corrupt_fixup[PKT_BURST_RX];
+			uint32_t cap_idx[PKT_BURST_RX];
+		} rx;
+		struct {
+			struct rte_mbuf *burst_buffer[PKT_BURST_WORKER];
+			uint64_t burst_deadline[PKT_BURST_WORKER];
+		} worker;
+		struct {
+			struct rte_mbuf *send_buf[PKT_BURST_TX];
+			uint64_t send_deadline[PKT_BURST_TX];
+		} tx;
+	};
+	/* packets captured by an RX or TX task, see demu_cap_tap() */
+	unsigned nb_cap;
+	struct rte_mbuf *cap_pkts[2 * PKT_BURST_RX];
+	uint64_t cap_meta[2 * PKT_BURST_RX];
 };
 
 struct port_t ports[RTE_MAX_ETHPORTS];
-uint8_t nb_lcores;
 uint8_t nb_ports;
+uint16_t nb_queues = 1;
 
 enum demu_loss_mode {
 	LOSS_MODE_NONE,
@@ -171,17 +342,297 @@ enum demu_loss_mode {
 	LOSS_MODE_GE,
 	LOSS_MODE_4STATE,
 };
-static enum demu_loss_mode loss_mode = LOSS_MODE_NONE;
 
-static uint64_t loss_percent_1 = 0;
-static uint64_t loss_percent_2 = 0;
-// static uint64_t change_percent_1 = 0;
-// static uint64_t change_percent_2 = 0;
+/* Discipline of the bottleneck queue in front of the rate */
+enum demu_aqm {
+	DEMU_AQM_DROPTAIL,
+	DEMU_AQM_RED,
+	DEMU_AQM_CODEL,
+	DEMU_AQM_FQ_CODEL,
+};
+
+/*
+ * Impairment parameters of one direction of a link, i.e. of the packets
+ * received on one port of a -P pair and sent out of its peer.
+ */
+struct demu_link_params {
+	uint64_t delayed_time;		/* TSC cycles */
+	uint64_t jitter_time;		/* TSC cycles */
+	uint32_t jitter_corr;		/* scaled to UINT32_MAX */
+	bool jitter_fifo;
+	enum demu_loss_mode loss_mode;
+	uint64_t loss_percent_1;
+	uint64_t loss_percent_2;
+	uint64_t dup_rate;
+	uint64_t limit_speed;		/* bps, 0 is unlimited */
+	const uint32_t *ber_table;	/* error probability by length, or NULL */
+	double ber;
+	bool ber_corrupt;		/* corrupt instead of dropping */
+	bool ber_csum;			/* fix the checksums of corrupted packets */
+	uint64_t slot_time;		/* TSC cycles, 0 releases packets one by one */
+	uint64_t slot_jitter;		/* TSC cycles */
+	uint32_t slot_pkts;		/* packets per slot, 0 is unlimited */
+	uint32_t slot_bytes;		/* bytes per slot, 0 is unlimited */
+	uint64_t reorder_rate;		/* scaled to RANDOM_MAX */
+	uint32_t reorder_corr;		/* scaled to UINT32_MAX */
+	uint32_t reorder_gap;		/* packets delayed between early ones */
+	/* bottleneck queue, used when the direction has a rate or a trace */
+	enum demu_aqm aqm;
+	bool ecn;			/* mark ECN capable packets instead of dropping */
+	uint32_t queue_limit;		/* packets, 0 is unlimited */
+	uint64_t queue_limit_bytes;	/* bytes, 0 is unlimited */
+	uint64_t aqm_target;		/* TSC cycles, CoDel */
+	uint64_t aqm_interval;		/* TSC cycles, CoDel */
+	uint32_t red_min;		/* packets, 0 is a quarter of the limit */
+	uint32_t red_max;		/* packets, 0 is three quarters of the limit */
+	uint32_t red_prob;		/* scaled to UINT32_MAX */
+};
+
+/*
+ * Traffic classes. Packets that match a --rules entry get the parameters
+ * of its class instead of the ones of the direction. Class 0 is the
+ * direction itself.
+ */
+#define DEMU_MAX_CLASSES 8
+
+/* Impairment state of one direction (or class) owned by one RX queue */
+struct demu_link_rxq {
+	bool ge_state;
+	char state_4;
+	uint32_t jitter_rnd;
+	uint32_t reorder_rnd;
+	uint32_t reorder_cnt;		/* packets delayed since the last early one */
+	uint64_t last_deadline;
+} __rte_cache_aligned;
+
+/*
+ * Time-varying parameters replayed from a profile file. The file is
+ * compiled at startup into one parameter set per change, and the timer
+ * lcore publishes the set of the current time as the link parameters.
+ */
+struct demu_profile {
+	uint32_t nb_entries;
+	uint32_t cur;
+	uint64_t base;			/* TSC of the start of the current period */
+	uint64_t next;			/* TSC of the next change, UINT64_MAX if none */
+	uint64_t period;		/* TSC cycles, 0 if the profile does not repeat */
+	uint64_t *start;		/* offset of each entry from base */
+	struct demu_link_params *entries;
+};
+
+/*
+ * Delivery opportunities replayed from a Mahimahi trace. Each line of
+ * the trace is the millisecond of one opportunity to send
+ * DEMU_TRACE_OPP_BYTES, and the trace repeats after its last
+ * millisecond. Opportunities of the same millisecond are merged.
+ */
+#define DEMU_TRACE_OPP_BYTES 1514	/* a 1500 byte MTU Ethernet frame */
+
+struct demu_trace_opp {
+	uint32_t ms;
+	uint32_t nb_opp;
+};
+
+struct demu_trace {
+	uint32_t nb_entries;
+	uint32_t cur;
+	uint32_t period;		/* ms */
+	uint64_t base;			/* TSC of the start of the current period */
+	uint64_t next;			/* TSC of entries[cur] */
+	struct demu_trace_opp *entries;
+};
+
+/*
+ * Impairment context of one direction. The RX queues, the TX queues and
+ * the timer lcore write to different cache lines, and the two directions
+ * of a link never share one.
+ *
+ * The parameters are never modified in place. The control thread
+ * publishes a new copy and frees the old one once every data path lcore
+ * has passed a quiescent state (see demu_qsbr_synchronize()).
+ */
+struct demu_link {
+	struct demu_link_params *params;
+	struct demu_profile *profile;
+	struct demu_trace *trace;	/* shape with the trace instead of the rate */
+	/* parameters of each class, NULL for the class 0 and unused classes */
+	struct demu_link_params *class_params[DEMU_MAX_CLASSES];
+	struct demu_link_rxq rxq[DEMU_MAX_QUEUES][DEMU_MAX_CLASSES];
+	/* virtual clock of the rate of each class, shared by the RX queues */
+	rte_atomic64_t class_vt[DEMU_MAX_CLASSES] __rte_cache_aligned;
+	/*
+	 * Impairments of the packets sent out of the port at each index:
+	 * the link itself, or a --path of the switch. NULL if none go there.
+	 */
+	struct demu_link *path[RTE_MAX_ETHPORTS];
+	/* token bucket of the rate limit, shared by the TX queues */
+	rte_atomic64_t amount_token __rte_cache_aligned;
+	uint64_t sub_amount_token;
+} __rte_cache_aligned;
+
+static struct demu_link demu_links[RTE_MAX_ETHPORTS];
+
+/* delay of each direction given by -P, in TSC cycles */
+static uint64_t demu_port_delay[RTE_MAX_ETHPORTS];
+
+static inline const struct demu_link_params *
+demu_link_params_get(const struct demu_link *link)
+{
+	return __atomic_load_n(&link->params, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Quiescent state based reclamation of the link parameters.
+ *
+ * A data path lcore that reads the parameters calls demu_qsbr_quiescent()
+ * once per loop iteration, when it holds no reference to them. A writer
+ * waits until every online lcore has done so after the new parameters
+ * were published. Reporting costs a single store on the data path.
+ */
+struct demu_qsbr {
+	uint64_t cnt;
+	bool online;
+} __rte_cache_aligned;
+
+static struct demu_qsbr demu_qsbr[RTE_MAX_LCORE];
+
+static inline void
+demu_qsbr_quiescent(unsigned lcore_id)
+{
+	__atomic_store_n(&demu_qsbr[lcore_id].cnt, demu_qsbr[lcore_id].cnt + 1,
+			__ATOMIC_RELEASE);
+}
+
+static inline void
+demu_qsbr_online(unsigned lcore_id)
+{
+	__atomic_store_n(&demu_qsbr[lcore_id].online, true, __ATOMIC_SEQ_CST);
+}
+
+static inline void
+demu_qsbr_offline(unsigned lcore_id)
+{
+	__atomic_store_n(&demu_qsbr[lcore_id].online, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * Idle lcores.
+ *
+ * With --idle-sleep, a data path lcore that finds no work steps down from
+ * busy polling: after DEMU_IDLE_SPIN empty polls in a row it pauses
+ * between polls, and after DEMU_IDLE_PAUSE it sleeps, offline for QSBR,
+ * until its next known work is due or for --idle-sleep at most. A worker
+ * knows the next deadline of its delay line, and publishes it for the TX
+ * lcores it releases to. The kernel wakes a thread up late by a few
+ * microseconds, so the lcore measures it on every sleep and wakes up
+ * that much earlier (an EWMA); what is left of it is shown with the
+ * stats. The latency idling adds to the packets is in their delay error.
+ */
+#define DEMU_IDLE_SPIN 256
+#define DEMU_IDLE_PAUSE 4096
+#define DEMU_IDLE_EWMA_SHIFT 3
+
+static uint64_t demu_idle_sleep;	/* TSC cycles, 0 to always poll */
+
+struct demu_idle {
+	uint32_t polls;		/* empty polls in a row */
+	uint64_t wake_late;	/* how late a sleep ends, TSC cycles */
+};
+
+static void
+demu_idle_init(struct demu_idle *idle)
+{
+	idle->polls = 0;
+	idle->wake_late = 0;
+	/* nanosleep() is otherwise rounded up by 50us */
+	if (demu_idle_sleep)
+		prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+}
+
+static inline void
+demu_idle_busy(struct demu_idle *idle)
+{
+	idle->polls = 0;
+}
+
+/*
+ * An empty poll of lcore_id, whose next work is due at the TSC until,
+ * UINT64_MAX if it does not know.
+ */
+static inline void
+demu_idle_poll(struct demu_idle *idle, unsigned lcore_id, uint64_t until,
+		struct demu_task_stats *stats)
+{
+	struct timespec ts;
+	uint64_t now, wake, late, ns;
+
+	if (likely(demu_idle_sleep == 0))
+		return;
+	if (++idle->polls < DEMU_IDLE_SPIN)
+		return;
+	now = rte_rdtsc();
+	if (idle->polls < DEMU_IDLE_PAUSE || until <= now + idle->wake_late) {
+		rte_pause();
+		return;
+	}
+
+	until = RTE_MIN(until, now + demu_idle_sleep);
+	wake = until - idle->wake_late;
+	ns = (wake - now) * NS_PER_S / rte_get_tsc_hz();
+	ts.tv_sec = ns / NS_PER_S;
+	ts.tv_nsec = ns % NS_PER_S;
+
+	demu_qsbr_offline(lcore_id);
+	nanosleep(&ts, NULL);
+	demu_qsbr_online(lcore_id);
+
+	now = rte_rdtsc();
+	late = now > wake ? now - wake : 0;
+	idle->wake_late += ((int64_t)late - (int64_t)idle->wake_late) >> DEMU_IDLE_EWMA_SHIFT;
+	stats->idle_sleeps++;
+	if (now > until)
+		stats->idle_late_max = RTE_MAX(stats->idle_late_max, now - until);
+}
+
+/*
+ * Wait until every online lcore has passed a quiescent state. Only the
+ * control thread waits, and it sleeps between the checks, so that it
+ * does not hold a CPU the data path lcores may need.
+ */
+static void
+demu_qsbr_synchronize(void)
+{
+	static const struct timespec backoff = {0, 10000};	/* 10us */
+	uint64_t snap[RTE_MAX_LCORE];
+	unsigned lcore_id;
+
+	RTE_LCORE_FOREACH(lcore_id)
+		snap[lcore_id] = __atomic_load_n(&demu_qsbr[lcore_id].cnt, __ATOMIC_ACQUIRE);
 
-static uint64_t dup_rate = 0;
+	RTE_LCORE_FOREACH(lcore_id) {
+		while (__atomic_load_n(&demu_qsbr[lcore_id].online, __ATOMIC_ACQUIRE) &&
+				__atomic_load_n(&demu_qsbr[lcore_id].cnt, __ATOMIC_ACQUIRE) ==
+				snap[lcore_id])
+			nanosleep(&backoff, NULL);
+	}
+}
+
+/* parameters given by the global options, applied to every direction */
+static struct demu_link_params demu_default_params = {
+	.loss_mode = LOSS_MODE_NONE,
+	.aqm = DEMU_AQM_DROPTAIL,
+	.reorder_gap = 1,
+	.queue_limit = 1000,
+	.red_prob = UINT32_MAX / 10,
+};
 
-static const struct rte_eth_conf port_conf = {
+/* CoDel defaults of RFC 8289 [us] */
+#define DEMU_CODEL_TARGET_US 5000
+#define DEMU_CODEL_INTERVAL_US 100000
+
+static struct rte_eth_conf port_conf = {
 	.rxmode = {
+		.mq_mode        = ETH_MQ_RX_NONE,
 		.split_hdr_size = 0,
 		.header_split   = 0, /**< Header Split disabled */
 		.hw_ip_checksum = 0, /**< IP checksum offload disabled */
@@ -192,6 +643,12 @@ static const struct rte_eth_conf port_conf = {
 	.txmode = {
 		.mq_mode = ETH_MQ_TX_NONE,
 	},
+	.rx_adv_conf = {
+		.rss_conf = {
+			.rss_key = NULL,
+			.rss_hf = ETH_RSS_IP | ETH_RSS_TCP | ETH_RSS_UDP,
+		},
+	},
 };
 
 static struct rte_eth_rxconf rx_conf = {
@@ -221,410 +678,5438 @@ static struct rte_eth_txconf tx_conf = {
 	.tx_deferred_start = 0,            /**< Do not start queue with rte_eth_dev_start(). */
 };
 
-/* #define DEBUG */
-/* #define DEBUG_RX */
-/* #define DEBUG_TX */
-
-#ifdef DEBUG_RX
-#define RX_STAT_BUF_SIZE 3000000
-double rx_stat[RX_STAT_BUF_SIZE] = {0};
-uint64_t rx_cnt = 0;
-#endif
+/*
+ * Per-lcore random number generator.
+ *
+ * Every lcore owns DEMU_RAND_LANES independent xoshiro128** generators
+ * and refills a buffer of random numbers from all of them at once. The
+ * lanes are laid out as arrays so that the refill loop is vectorized
+ * (8 x 32-bit lanes fit an AVX2 register). Nothing is shared between
+ * lcores, and the generators are seeded from --seed and the lcore id,
+ * so an experiment can be replayed with the same loss and duplication
+ * pattern.
+ */
+#define DEMU_RAND_LANES 8
+#define DEMU_RAND_BUF_SIZE 1024
 
-#ifdef DEBUG_TX
-#define TX_STAT_BUF_SIZE 3000000
-double tx_stat[TX_STAT_BUF_SIZE] = {0};
-uint64_t tx_cnt = 0;
-#endif
+struct demu_rand {
+	uint32_t s[4][DEMU_RAND_LANES];
+	uint32_t pos;
+	uint32_t buf[DEMU_RAND_BUF_SIZE];
+} __rte_cache_aligned;
 
+static struct demu_rand demu_rand_state[RTE_MAX_LCORE];
+static uint64_t demu_rand_seed;
+static bool demu_rand_seed_set = false;
 
-static inline void
-pktmbuf_free_bulk(struct rte_mbuf *mbuf_table[], unsigned n)
+static inline uint32_t
+demu_rand_rotl(uint32_t x, int k)
 {
-	unsigned int i;
-
-	for (i = 0; i < n; i++)
-		rte_pktmbuf_free(mbuf_table[i]);
+	return (x << k) | (x >> (32 - k));
 }
 
-static uint64_t amount_token = 0;
-static uint64_t limit_speed = 0;
-static uint64_t sub_amount_token = 0;
-
 static void
-tx_timer_cb(__attribute__((unused)) struct rte_timer *tmpTime, __attribute__((unused)) void *arg)
+demu_rand_refill(struct demu_rand *r)
 {
-	double upper_limit_speed = limit_speed * 1.2;
-	if (amount_token >= (uint64_t)upper_limit_speed)
-		return;
-
-	if (limit_speed >= 1000000)
-		amount_token += (limit_speed / 1000000);
-	else {
-		sub_amount_token += limit_speed;
-		if (sub_amount_token > 1000000) {
-			amount_token += sub_amount_token / 1000000;
-			sub_amount_token %= 1000000;
+	uint32_t *s0 = r->s[0], *s1 = r->s[1], *s2 = r->s[2], *s3 = r->s[3];
+	uint32_t t;
+	unsigned n, l;
+
+	for (n = 0; n < DEMU_RAND_BUF_SIZE; n += DEMU_RAND_LANES) {
+		for (l = 0; l < DEMU_RAND_LANES; l++) {
+			r->buf[n + l] = demu_rand_rotl(s1[l] * 5, 7) * 9;
+			t = s1[l] << 9;
+			s2[l] ^= s0[l];
+			s3[l] ^= s1[l];
+			s1[l] ^= s2[l];
+			s0[l] ^= s3[l];
+			s2[l] ^= t;
+			s3[l] = demu_rand_rotl(s3[l], 11);
 		}
 	}
+	r->pos = 0;
 }
 
-static void
-demu_timer_loop(void)
+static inline uint32_t
+demu_rand_get(struct demu_rand *r)
 {
-	unsigned lcore_id;
-	uint64_t hz;
-	struct rte_timer timer;
-
-	lcore_id = rte_lcore_id();
-	hz = rte_get_timer_hz();
+	if (unlikely(r->pos == DEMU_RAND_BUF_SIZE))
+		demu_rand_refill(r);
+	return r->buf[r->pos++];
+}
 
-	rte_timer_init(&timer);
-	rte_timer_reset(&timer, hz / 1000000, PERIODICAL, lcore_id, tx_timer_cb, NULL);
+/* Make sure the next n numbers come from the buffer without a refill. */
+static inline void
+demu_rand_reserve(struct demu_rand *r, unsigned n)
+{
+	if (DEMU_RAND_BUF_SIZE - r->pos < n)
+		demu_rand_refill(r);
+}
 
-	RTE_LOG(INFO, DEMU, "Entering timer loop on lcore %u\n", lcore_id);
-	RTE_LOG(INFO, DEMU, "  Linit speed is %lu bps\n", limit_speed);
+static uint64_t
+demu_rand_splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
 
-	while (!force_quit)
-		rte_timer_manage();
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
 }
 
 static void
-demu_tx_loop(struct port_t port)
+demu_rand_init(void)
 {
-	struct rte_mbuf *send_buf[PKT_BURST_TX];
-	unsigned lcore_id;
-	uint32_t numdeq = 0;
-	uint16_t sent;
-	uint16_t pkt_size_bit;
-	uint32_t num_send = 0;
-	uint16_t prevent_discard = 0;
+	unsigned lcore_id, l, i;
+	uint64_t x, v;
+
+	if (!demu_rand_seed_set)
+		demu_rand_seed = rte_rdtsc();
+	RTE_LOG(INFO, DEMU, "Random seed is %" PRIu64 "\n", demu_rand_seed);
+	rte_srand(demu_rand_seed);
+
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		struct demu_rand *r = &demu_rand_state[lcore_id];
+
+		x = demu_rand_seed ^ ((uint64_t)lcore_id << 48);
+		for (l = 0; l < DEMU_RAND_LANES; l++) {
+			for (i = 0; i < 4; i += 2) {
+				v = demu_rand_splitmix64(&x);
+				r->s[i][l] = (uint32_t)v;
+				r->s[i + 1][l] = (uint32_t)(v >> 32);
+			}
+		}
+		r->pos = DEMU_RAND_BUF_SIZE;
+	}
+}
 
-	lcore_id = rte_lcore_id();
+static int
+demu_stats_init(void)
+{
+	const struct rte_memzone *mz;
 
-	RTE_LOG(INFO, DEMU, "Entering main tx loop on lcore %u portid %u\n", lcore_id, port.portid);
+	mz = rte_memzone_reserve(DEMU_STATS_MZ_NAME, sizeof(*demu_stats),
+			rte_socket_id(), 0);
+	if (mz == NULL)
+		return -1;
+	demu_stats = mz->addr;
+	memset(demu_stats, 0, sizeof(*demu_stats));
 
-	while (!force_quit) {
-		numdeq = rte_ring_sc_dequeue_burst(port.workers_to_tx,
-				(void *)(send_buf + prevent_discard), PKT_BURST_TX, NULL);
+	return 0;
+}
 
-		if (unlikely(numdeq == 0))
-			continue;
+/* Counters of task idx, which handles portid */
+static struct demu_task_stats *
+demu_stats_task(unsigned idx, uint16_t portid)
+{
+	struct demu_task_stats *stats = &demu_stats->task[idx];
 
-		if (limit_speed) {
-			num_send = 0;
-			for (uint32_t j = 0; j < numdeq + prevent_discard; j++) {
-				pkt_size_bit = send_buf[j]->pkt_len * 8;
-				if (amount_token >= pkt_size_bit) {
-					amount_token -= pkt_size_bit;
-					num_send++;
-				} else break;
-			}
-			rte_prefetch0(rte_pktmbuf_mtod(send_buf[0], void *));
-			sent = rte_eth_tx_burst(port.portid, 0, send_buf, num_send);
+	stats->portid = portid;
+	stats->used = true;
 
-			if (prevent_discard < PKT_BURST_TX) {
-				prevent_discard = numdeq + prevent_discard - num_send;
-			}
-		} else {
-			rte_prefetch0(rte_pktmbuf_mtod(send_buf[0], void *));
-			sent = 0;
-			while (numdeq > sent)
-				sent += rte_eth_tx_burst(port.portid, 0, send_buf + sent, numdeq - sent);
-		}
+	return stats;
+}
 
-#ifdef DEBUG_TX
-		if (tx_cnt < TX_STAT_BUF_SIZE) {
-			for (uint32_t i = 0; i < numdeq; i++) {
-				tx_stat[tx_cnt] = rte_rdtsc();
-				tx_cnt++;
-			}
-		}
-#endif
-		if (limit_speed) {
-			if (prevent_discard >= (uint16_t)(PKT_BURST_TX * 0.8)) {
-				pktmbuf_free_bulk(&send_buf[sent], numdeq - sent);
-				prevent_discard = 0;
-			}
-		}
-#ifdef DEBUG
-		else {
-			// printf("tx:%u %u\n", numdeq, sent);
-			port_statistics[port.portid].tx += sent;
-			port_statistics[port.portid].dropped += (numdeq - sent);
-		}
-#endif
-	}
+/* Histogram of task idx, which sends the packets received on portid */
+static struct demu_hist *
+demu_hist_task(unsigned idx, uint16_t portid)
+{
+	struct demu_hist *hist = &demu_stats->hist[idx];
+
+	hist->portid = portid;
+	hist->used = true;
+
+	return hist;
 }
 
-static void
-demu_rx_loop(struct port_t port)
+static inline unsigned
+demu_hist_index(uint64_t v)
 {
-	struct rte_mbuf *pkts_burst[PKT_BURST_RX], *rx2w_buffer[PKT_BURST_RX];
-	unsigned lcore_id;
+	unsigned e;
 
-	unsigned nb_rx, i;
-	unsigned nb_loss;
-	unsigned nb_dup;
-	uint32_t numenq;
+	if (v < DEMU_HIST_SUB_COUNT)
+		return v;
+	e = 63 - __builtin_clzll(v);
+
+	return ((e - DEMU_HIST_SUB_BITS + 1) << DEMU_HIST_SUB_BITS) +
+		((v >> (e - DEMU_HIST_SUB_BITS)) & (DEMU_HIST_SUB_COUNT - 1));
+}
 
-	lcore_id = rte_lcore_id();
+/* Highest value that falls in bucket idx */
+static uint64_t
+demu_hist_value(unsigned idx)
+{
+	unsigned shift;
 
-	RTE_LOG(INFO, DEMU, "Entering main rx loop on lcore %u portid %u\n", lcore_id, port.portid);
+	if (idx < DEMU_HIST_SUB_COUNT)
+		return idx;
+	shift = (idx >> DEMU_HIST_SUB_BITS) - 1;
 
-	while (!force_quit) {
-		nb_rx = rte_eth_rx_burst((uint8_t) port.portid, 0,
-				pkts_burst, PKT_BURST_RX);
+	return (((uint64_t)(DEMU_HIST_SUB_COUNT + (idx & (DEMU_HIST_SUB_COUNT - 1))) + 1)
+			<< shift) - 1;
+}
+
+/* Record the lateness of the packets with deadline[] about to be sent at now */
+static inline void
+demu_hist_record(struct demu_hist *hist, const uint64_t *deadline, unsigned n, uint64_t now)
+{
+	for (unsigned i = 0; i < n; i++) {
+		uint64_t late;
 
-		if (likely(nb_rx == 0))
+		if (unlikely(now < deadline[i])) {
+			hist->early++;
 			continue;
+		}
+		late = now - deadline[i];
+		hist->count[demu_hist_index(late)]++;
+		if (unlikely(late > hist->max))
+			hist->max = late;
+	}
+}
 
-#ifdef DEBUG
-		port_statistics[port.portid].rx += nb_rx;
-#endif
-		nb_loss = 0;
-		nb_dup = 0;
-		for (i = 0; i < nb_rx; i++) {
-			struct rte_mbuf *clone;
+/* Print the percentiles and the maximum of t in us, and return its count */
+static uint64_t
+demu_hist_print_pct(FILE *out, const struct demu_hist *t)
+{
+	static const double pct[] = {50, 99, 99.9};
+	double tsc_per_us = (double)rte_get_tsc_hz() / US_PER_S;
+	uint64_t total = 0, seen = 0;
+	unsigned b;
+
+	for (b = 0; b < DEMU_HIST_BUCKETS; b++)
+		total += t->count[b];
+	b = 0;
+	for (unsigned k = 0; k < RTE_DIM(pct); k++) {
+		while (b < DEMU_HIST_BUCKETS && total &&
+				seen + t->count[b] < (uint64_t)ceil(total * pct[k] / 100)) {
+			seen += t->count[b];
+			b++;
+		}
+		fprintf(out, " p%g %.2f", pct[k],
+				total ? RTE_MIN(demu_hist_value(b), t->max) / tsc_per_us : 0);
+	}
+	fprintf(out, " max %.2f", t->max / tsc_per_us);
 
-			if (loss_event()) {
-				port_statistics[port.portid].discarded++;
-				nb_loss++;
-				continue;
-			}
+	return total;
+}
 
-			rx2w_buffer[i - nb_loss + nb_dup] = pkts_burst[i];
-			rte_prefetch0(rte_pktmbuf_mtod(rx2w_buffer[i - nb_loss + nb_dup], void *));
-			rx2w_buffer[i - nb_loss + nb_dup]->udata64 = rte_rdtsc();
-
-			/* FIXME: we do not check the buffer overrun of rx2w_buffer. */
-			if (dup_event()) {
-				clone = rte_pktmbuf_clone(rx2w_buffer[i - nb_loss + nb_dup], demu_pktmbuf_pool);
-				if (clone == NULL)
-					RTE_LOG(ERR, DEMU, "cannot clone a packet\n");
-				nb_dup++;
-				rx2w_buffer[i - nb_loss + nb_dup] = clone;
-			}
+/* Print the delay error percentiles of each direction */
+static void
+demu_hist_print(FILE *out, const struct demu_stats *s)
+{
+	struct demu_hist *sum;
 
-#ifdef DEBUG_RX
-			if (rx_cnt < RX_STAT_BUF_SIZE) {
-				rx_stat[rx_cnt] = rte_rdtsc();
-				rx_cnt++;
-			}
-#endif
-		}
+	sum = calloc(RTE_MAX_ETHPORTS, sizeof(*sum));
+	if (sum == NULL)
+		return;
+	for (unsigned i = 0; i < DEMU_MAX_TASKS; i++) {
+		const volatile struct demu_hist *h = &s->hist[i];
+		struct demu_hist *t;
 
-		numenq = rte_ring_sp_enqueue_burst(port.rx_to_workers,
-					(void *)rx2w_buffer, nb_rx - nb_loss + nb_dup, NULL);
+		if (!h->used || h->portid >= RTE_MAX_ETHPORTS)
+			continue;
+		t = &sum[h->portid];
+		for (unsigned b = 0; b < DEMU_HIST_BUCKETS; b++)
+			t->count[b] += h->count[b];
+		t->early += h->early;
+		t->max = RTE_MAX(t->max, (uint64_t)h->max);
+		t->used = true;
+	}
 
+	for (unsigned i = 0; i < RTE_MAX_ETHPORTS; i++) {
+		const struct demu_hist *t = &sum[i];
+		uint64_t total;
 
-		if (unlikely(numenq < (unsigned)(nb_rx - nb_loss + nb_dup))) {
-#ifdef DEBUG
-			port_statistics[port.portid].rx_worker_dropped += (nb_rx - nb_loss + nb_dup - numenq);
-			printf("Delayed Queue Overflow count:%" PRIu64 "\n",
-					port_statistics[port.portid].queue_dropped);
-#endif
-			pktmbuf_free_bulk(&pkts_burst[numenq], nb_rx - nb_loss + nb_dup - numenq);
-		}
+		if (!t->used)
+			continue;
+		fprintf(out, "port %u: delay error", i);
+		total = demu_hist_print_pct(out, t);
+		fprintf(out, " us (%" PRIu64 " packets, %" PRIu64 " early)\n",
+				total, t->early);
 	}
+	free(sum);
 }
 
+/* Sum the counters of the tasks of each port into sum[portid] */
 static void
-worker_thread(struct port_t port)
+demu_stats_sum(const struct demu_stats *s, struct demu_task_stats *sum)
 {
-	uint16_t burst_size = 0;
-	struct rte_mbuf *burst_buffer[PKT_BURST_WORKER];
-	uint64_t diff_tsc;
-	int i;
-	unsigned lcore_id;
+	memset(sum, 0, sizeof(*sum) * RTE_MAX_ETHPORTS);
+	for (unsigned i = 0; i < DEMU_MAX_TASKS; i++) {
+		const volatile struct demu_task_stats *l = &s->task[i];
+		struct demu_task_stats *t;
 
-	lcore_id = rte_lcore_id();
-	RTE_LOG(INFO, DEMU, "Entering main worker on lcore %u\n", lcore_id);
-	i = 0;
+		if (!l->used || l->portid >= RTE_MAX_ETHPORTS)
+			continue;
+		t = &sum[l->portid];
+		t->rx += l->rx;
+		t->tx += l->tx;
+		t->loss += l->loss;
+		t->dup += l->dup;
+		t->ring_overflow += l->ring_overflow;
+		t->shaping_dropped += l->shaping_dropped;
+		t->queue_dropped += l->queue_dropped;
+		t->ecn_marked += l->ecn_marked;
+		t->corrupted += l->corrupted;
+		t->tx_retry += l->tx_retry;
+		t->filtered += l->filtered;
+		t->held += l->held;
+		t->idle_sleeps += l->idle_sleeps;
+		t->idle_late_max = RTE_MAX(t->idle_late_max, l->idle_late_max);
+		t->cap_missed += l->cap_missed;
+		t->used = true;
+	}
+}
 
-	while (!force_quit) {
-			burst_size = rte_ring_sc_dequeue_burst(port.rx_to_workers,
-					(void *)burst_buffer, PKT_BURST_WORKER, NULL);
-		if (unlikely(burst_size == 0))
+static void
+demu_stats_print_sum(FILE *out, const struct demu_task_stats *sum)
+{
+	for (unsigned i = 0; i < RTE_MAX_ETHPORTS; i++) {
+		const struct demu_task_stats *t = &sum[i];
+
+		if (!t->used)
 			continue;
-		rte_prefetch0(rte_pktmbuf_mtod(burst_buffer[0], void *));
-		i = 0;
-		while (i != burst_size) {
-			diff_tsc = rte_rdtsc() - burst_buffer[i]->udata64;
-			if (diff_tsc >= port.delayed_time) {
-				rte_prefetch0(rte_pktmbuf_mtod(burst_buffer[i], void *));
-				rte_ring_sp_enqueue(port.workers_to_tx_other, burst_buffer[i]);
-				i++;
-			}
-		}
+		fprintf(out, "port %u: rx %" PRIu64 " tx %" PRIu64 " loss %" PRIu64
+				" dup %" PRIu64 " corrupt %" PRIu64 " overflow %" PRIu64
+				" shaping %" PRIu64 " queue %" PRIu64 " ecn %" PRIu64
+				" tx-retry %" PRIu64 " filtered %" PRIu64 " held %" PRIu64 "\n",
+				i, t->rx, t->tx, t->loss, t->dup, t->corrupted, t->ring_overflow,
+				t->shaping_dropped, t->queue_dropped, t->ecn_marked, t->tx_retry,
+				t->filtered, t->held);
+		if (t->idle_sleeps)
+			fprintf(out, "port %u: idle sleeps %" PRIu64 " wake-up late max %.2f us\n",
+					i, t->idle_sleeps,
+					(double)t->idle_late_max * US_PER_S / rte_get_tsc_hz());
+		if (t->cap_missed)
+			fprintf(out, "port %u: capture missed %" PRIu64 "\n", i, t->cap_missed);
 	}
 }
 
-static int
-demu_launch_one_lcore(__attribute__((unused)) void *dummy)
+static void
+demu_stats_print(FILE *out)
 {
-	unsigned lcore_id, lcore_idx;
-	lcore_id = rte_lcore_id();
-	lcore_idx = rte_lcore_index(lcore_id);
+	struct demu_task_stats sum[RTE_MAX_ETHPORTS];
 
-	/* each port uses 3 lcores */
-	uint8_t port_idx = lcore_idx/3;
-	enum thread_type_t thread_type = lcore_idx%3;
+	demu_stats_sum(demu_stats, sum);
+	demu_stats_print_sum(out, sum);
+	demu_hist_print(out, demu_stats);
+}
 
-	/* last lcore is for timer_loop */
-	if (lcore_idx + 1 == nb_lcores) {
-		if (limit_speed) demu_timer_loop();
+/* Print the counters of the primary process every second */
+static int
+demu_stats_monitor(void)
+{
+	const struct rte_memzone *mz;
+	const struct demu_stats *s;
+	struct demu_task_stats sum[RTE_MAX_ETHPORTS];
+
+	mz = rte_memzone_lookup(DEMU_STATS_MZ_NAME);
+	if (mz == NULL) {
+		RTE_LOG(ERR, DEMU, "Cannot find memzone %s, is demu running?\n",
+				DEMU_STATS_MZ_NAME);
+		return -1;
 	}
+	s = mz->addr;
 
-	else if (thread_type == RX) {
-		demu_tx_loop(ports[port_idx]);
+	while (!force_quit) {
+		demu_stats_sum(s, sum);
+		demu_stats_print_sum(stdout, sum);
+		demu_hist_print(stdout, s);
+		printf("\n");
+		fflush(stdout);
+		sleep(1);
 	}
 
-	else if (thread_type == TX) {
-		worker_thread(ports[port_idx]);
+	return 0;
+}
+
+/*
+ * Packet rings.
+ *
+ * The pipeline stages hand packets over in single producer, single
+ * consumer rings that keep the deadline of each packet in an array next
+ * to the mbuf pointers. The deadlines never go through the mbufs, so a
+ * packet's headers are only touched again when it is sent, and the
+ * worker can find the due packets of a burst with vector compares.
+ */
+struct demu_dq {
+	uint32_t size;
+	uint32_t mask;
+	struct rte_mbuf **mbuf;
+	uint64_t *deadline;
+	uint32_t head __rte_cache_aligned;	/* written by the producer */
+	uint32_t tail __rte_cache_aligned;	/* written by the consumer */
+} __rte_cache_aligned;
+
+static struct demu_dq *
+demu_dq_create(uint32_t size, int socket_id)
+{
+	struct demu_dq *q;
+
+	size = rte_align32pow2(size);
+	q = rte_zmalloc_socket("demu_dq", sizeof(*q), RTE_CACHE_LINE_SIZE, socket_id);
+	if (q == NULL)
+		return NULL;
+	q->mbuf = rte_malloc_socket("demu_dq_mbuf", sizeof(*q->mbuf) * size,
+			RTE_CACHE_LINE_SIZE, socket_id);
+	q->deadline = rte_malloc_socket("demu_dq_deadline", sizeof(*q->deadline) * size,
+			RTE_CACHE_LINE_SIZE, socket_id);
+	if (q->mbuf == NULL || q->deadline == NULL) {
+		rte_free(q->mbuf);
+		rte_free(q->deadline);
+		rte_free(q);
+		return NULL;
 	}
+	q->size = size;
+	q->mask = size - 1;
+
+	return q;
+}
 
-	else if (thread_type == WORKER) {
-		demu_rx_loop(ports[port_idx]);
+/* Copy n entries between the ring at idx and the arrays, across the wrap */
+static inline void
+demu_dq_copy(struct demu_dq *q, uint32_t idx, struct rte_mbuf **m, uint64_t *d,
+		unsigned n, bool to_ring)
+{
+	uint32_t first;
+
+	idx &= q->mask;
+	first = RTE_MIN(n, q->size - idx);
+	if (to_ring) {
+		rte_memcpy(&q->mbuf[idx], m, sizeof(*m) * first);
+		rte_memcpy(&q->deadline[idx], d, sizeof(*d) * first);
+		rte_memcpy(q->mbuf, m + first, sizeof(*m) * (n - first));
+		rte_memcpy(q->deadline, d + first, sizeof(*d) * (n - first));
+	} else {
+		rte_memcpy(m, &q->mbuf[idx], sizeof(*m) * first);
+		rte_memcpy(d, &q->deadline[idx], sizeof(*d) * first);
+		rte_memcpy(m + first, q->mbuf, sizeof(*m) * (n - first));
+		rte_memcpy(d + first, q->deadline, sizeof(*d) * (n - first));
 	}
+}
+
+static inline unsigned
+demu_dq_enqueue_burst(struct demu_dq *q, struct rte_mbuf **m, uint64_t *d, unsigned n)
+{
+	uint32_t head = q->head;
+	uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
 
-	if (force_quit)
+	n = RTE_MIN(n, q->size - (head - tail));
+	if (n == 0)
 		return 0;
+	demu_dq_copy(q, head, m, d, n, true);
+	__atomic_store_n(&q->head, head + n, __ATOMIC_RELEASE);
 
-	return 0;
+	return n;
 }
 
-/* display usage */
-static void
-demu_usage(const char *prgname)
+static inline unsigned
+demu_dq_dequeue_burst(struct demu_dq *q, struct rte_mbuf **m, uint64_t *d, unsigned n)
+{
+	uint32_t tail = q->tail;
+	uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+	n = RTE_MIN(n, head - tail);
+	if (n == 0)
+		return 0;
+	demu_dq_copy(q, tail, m, d, n, false);
+	__atomic_store_n(&q->tail, tail + n, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+/* Number of leading deadlines of d[0..n) that are due at now */
+static inline unsigned
+demu_deadline_scan(const uint64_t *d, unsigned n, uint64_t now)
+{
+	unsigned i = 0;
+
+#if defined(__AVX512F__)
+	__m512i vnow = _mm512_set1_epi64(now);
+
+	for (; i + 8 <= n; i += 8) {
+		__mmask8 late = _mm512_cmpgt_epu64_mask(_mm512_loadu_si512(d + i), vnow);
+
+		if (late)
+			return i + __builtin_ctz(late);
+	}
+#elif defined(__AVX2__)
+	/* AVX2 only compares signed integers, the TSC does not reach 2^63 */
+	__m256i vnow = _mm256_set1_epi64x(now);
+
+	for (; i + 4 <= n; i += 4) {
+		__m256i gt = _mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i *)(d + i)), vnow);
+		int late = _mm256_movemask_pd(_mm256_castsi256_pd(gt));
+
+		if (late)
+			return i + __builtin_ctz(late);
+	}
+#endif
+	for (; i < n; i++)
+		if (d[i] > now)
+			break;
+
+	return i;
+}
+
+/*
+ * Dequeue the packets at the head of the ring that are due at now, up
+ * to n. Only the deadline array is read to find them.
+ */
+static inline unsigned
+demu_dq_dequeue_due(struct demu_dq *q, uint64_t now, struct rte_mbuf **m, uint64_t *d,
+		unsigned n)
+{
+	uint32_t tail = q->tail;
+	uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	uint32_t idx = tail & q->mask;
+	unsigned first, due;
+
+	n = RTE_MIN(n, head - tail);
+	first = RTE_MIN(n, q->size - idx);
+	due = demu_deadline_scan(&q->deadline[idx], first, now);
+	if (due == first && n > first)
+		due += demu_deadline_scan(q->deadline, n - first, now);
+	if (due == 0)
+		return 0;
+	demu_dq_copy(q, tail, m, d, due, false);
+	__atomic_store_n(&q->tail, tail + due, __ATOMIC_RELEASE);
+
+	return due;
+}
+
+/* Deadline of the packet at the head of q, UINT64_MAX if it is empty */
+static inline uint64_t
+demu_dq_next_deadline(const struct demu_dq *q)
+{
+	uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+	if (head == q->tail)
+		return UINT64_MAX;
+	return q->deadline[q->tail & q->mask];
+}
+
+/*
+ * Move a small packet into an mbuf of the small size class, so that it
+ * does not hold an MTU-sized buffer while it is delayed. The packet is
+ * kept as is if the small pool is empty.
+ */
+static inline struct rte_mbuf *
+demu_pktmbuf_shrink(struct rte_mbuf *m, struct rte_mempool *small_pool)
+{
+	struct rte_mbuf *s;
+
+	if (m->pkt_len > DEMU_SMALL_PKT_SIZE || m->nb_segs != 1)
+		return m;
+	s = rte_pktmbuf_alloc(small_pool);
+	if (unlikely(s == NULL))
+		return m;
+
+	rte_memcpy(rte_pktmbuf_mtod(s, void *), rte_pktmbuf_mtod(m, void *), m->data_len);
+	s->data_len = m->data_len;
+	s->pkt_len = m->pkt_len;
+	s->port = m->port;
+	s->ol_flags = m->ol_flags;
+	s->packet_type = m->packet_type;
+	s->vlan_tci = m->vlan_tci;
+	s->hash = m->hash;
+	rte_pktmbuf_free(m);
+
+	return s;
+}
+
+static inline void
+pktmbuf_free_bulk(struct rte_mbuf *mbuf_table[], unsigned n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		rte_pktmbuf_free(mbuf_table[i]);
+}
+
+static void
+demu_link_refill(struct demu_link *link)
+{
+	uint64_t limit_speed = demu_link_params_get(link)->limit_speed;
+	double upper_limit_speed = limit_speed * 1.2;
+
+	if (limit_speed == 0 || link->trace != NULL)
+		return;
+	if (rte_atomic64_read(&link->amount_token) >= (int64_t)upper_limit_speed)
+		return;
+
+	if (limit_speed >= 1000000)
+		rte_atomic64_add(&link->amount_token, limit_speed / 1000000);
+	else {
+		link->sub_amount_token += limit_speed;
+		if (link->sub_amount_token > 1000000) {
+			rte_atomic64_add(&link->amount_token, link->sub_amount_token / 1000000);
+			link->sub_amount_token %= 1000000;
+		}
+	}
+}
+
+static void
+tx_timer_cb(__attribute__((unused)) struct rte_timer *tmpTime, __attribute__((unused)) void *arg)
+{
+	for (int i = 0; i < nb_ports; i++) {
+		struct demu_link *link = &demu_links[i];
+
+		demu_link_refill(link);
+		for (int e = 0; e < nb_ports; e++)
+			if (link->path[e] != NULL && link->path[e] != link)
+				demu_link_refill(link->path[e]);
+	}
+}
+
+/*
+ * Move the profiles to the entries of now and publish them. Returns the
+ * TSC of the next change.
+ */
+static uint64_t
+demu_profile_step(uint64_t now)
+{
+	uint64_t next = UINT64_MAX;
+
+	for (int i = 0; i < nb_ports; i++) {
+		struct demu_link *link = &demu_links[i];
+		struct demu_profile *pr = link->profile;
+		uint32_t cur;
+
+		if (pr == NULL)
+			continue;
+		if (now < pr->next) {
+			next = RTE_MIN(next, pr->next);
+			continue;
+		}
+
+		cur = pr->cur;
+		while (now >= pr->next) {
+			if (cur + 1 < pr->nb_entries) {
+				cur++;
+			} else {
+				/* pr->next is only finite at the end if it repeats */
+				pr->base += pr->period;
+				cur = 0;
+			}
+			if (cur + 1 < pr->nb_entries)
+				pr->next = pr->base + pr->start[cur + 1];
+			else if (pr->period)
+				pr->next = pr->base + pr->period;
+			else
+				pr->next = UINT64_MAX;
+		}
+		pr->cur = cur;
+		__atomic_store_n(&link->params, &pr->entries[cur], __ATOMIC_RELEASE);
+		next = RTE_MIN(next, pr->next);
+	}
+
+	return next;
+}
+
+/*
+ * Give the TX lcores of each trace link the opportunities due at now.
+ * Unused opportunities are lost, as in Mahimahi, so what is left of the
+ * previous ones is dropped, but a debt TX ran up by sending a packet
+ * larger than the tokens left is paid from the new ones. Returns the
+ * TSC of the next opportunity.
+ */
+static uint64_t
+demu_trace_step(uint64_t now)
+{
+	uint64_t next = UINT64_MAX;
+	uint64_t tsc_per_ms = rte_get_tsc_hz() / MS_PER_S;
+
+	for (int i = 0; i < nb_ports; i++) {
+		struct demu_link *link = &demu_links[i];
+		struct demu_trace *tr = link->trace;
+		uint64_t bytes = 0;
+
+		if (tr == NULL)
+			continue;
+		while (now >= tr->next) {
+			bytes += (uint64_t)tr->entries[tr->cur].nb_opp * DEMU_TRACE_OPP_BYTES;
+			if (++tr->cur == tr->nb_entries) {
+				tr->cur = 0;
+				tr->base += tr->period * tsc_per_ms;
+			}
+			tr->next = tr->base + tr->entries[tr->cur].ms * tsc_per_ms;
+		}
+		if (bytes) {
+			int64_t cur;
+
+			/* TX takes tokens concurrently */
+			do {
+				cur = rte_atomic64_read(&link->amount_token);
+			} while (!rte_atomic64_cmpset((volatile uint64_t *)&link->amount_token.cnt,
+						cur, RTE_MIN(cur, 0) + (int64_t)bytes * 8));
+		}
+		next = RTE_MIN(next, tr->next);
+	}
+
+	return next;
+}
+
+static uint64_t
+demu_trace_start(uint64_t now)
+{
+	uint64_t next = UINT64_MAX;
+
+	for (int i = 0; i < nb_ports; i++) {
+		struct demu_trace *tr = demu_links[i].trace;
+
+		if (tr == NULL)
+			continue;
+		tr->base = now;
+		tr->cur = 0;
+		tr->next = now + tr->entries[0].ms * (rte_get_tsc_hz() / MS_PER_S);
+		next = RTE_MIN(next, tr->next);
+	}
+
+	return next;
+}
+
+/* Start the profiles at now */
+static uint64_t
+demu_profile_start(uint64_t now)
+{
+	uint64_t next = UINT64_MAX;
+
+	for (int i = 0; i < nb_ports; i++) {
+		struct demu_profile *pr = demu_links[i].profile;
+
+		if (pr == NULL)
+			continue;
+		pr->base = now;
+		pr->cur = 0;
+		if (pr->nb_entries > 1)
+			pr->next = now + pr->start[1];
+		else if (pr->period)
+			pr->next = now + pr->period;
+		else
+			pr->next = UINT64_MAX;
+		next = RTE_MIN(next, pr->next);
+	}
+
+	return next;
+}
+
+static struct rte_timer demu_timer;
+static uint64_t demu_timer_next_change;
+
+/* Start the token bucket timer and the profiles on lcore_id */
+static void
+demu_timer_init(unsigned lcore_id)
+{
+	uint64_t hz = rte_get_timer_hz();
+	uint64_t now;
+
+	rte_timer_init(&demu_timer);
+	rte_timer_reset(&demu_timer, hz / 1000000, PERIODICAL, lcore_id, tx_timer_cb, NULL);
+
+	for (int i = 0; i < nb_ports; i++)
+		if (demu_links[i].trace)
+			RTE_LOG(INFO, DEMU, "  Port %u is shaped by a trace\n", ports[i].portid);
+		else if (demu_links[i].params->limit_speed)
+			RTE_LOG(INFO, DEMU, "  Limit speed of port %u is %lu bps\n",
+					ports[i].portid, demu_links[i].params->limit_speed);
+
+	now = rte_rdtsc();
+	demu_timer_next_change = RTE_MIN(demu_profile_start(now), demu_trace_start(now));
+}
+
+/*
+ * Refill the token buckets and step the profiles. The timer is always
+ * busy, since its 1us refill cannot be put off.
+ */
+static bool
+demu_timer_poll(void)
+{
+	uint64_t now;
+
+	rte_timer_manage();
+	if (unlikely(demu_timer_next_change != UINT64_MAX)) {
+		now = rte_rdtsc();
+		if (now >= demu_timer_next_change)
+			demu_timer_next_change = RTE_MIN(demu_profile_step(now),
+					demu_trace_step(now));
+	}
+
+	return true;
+}
+
+/*
+ * Bottleneck queue.
+ *
+ * When a direction has a rate (or a trace), the packets that leave the
+ * delay line wait for the tokens of the rate in a queue of limited size,
+ * like in the buffer of the router in front of a slower link. Each TX
+ * queue has its own queue, holding its share of the limits, managed by
+ * one of the disciplines of enum demu_aqm.
+ *
+ * The packets are kept in a preallocated array of nodes, linked into one
+ * FIFO per flow. Drop-tail, RED and CoDel put every packet in flow 0;
+ * FQ-CoDel hashes the packets into DEMU_FQ_FLOWS flows, each with its own
+ * CoDel state. The flows are always served by deficit round robin as in
+ * RFC 8290, which with a single flow is a plain FIFO.
+ */
+#define DEMU_FQ_FLOWS 1024
+#define DEMU_FQ_QUANTUM 1514
+#define DEMU_FQ_DROP_BATCH 64
+#define DEMU_BQ_NIL UINT32_MAX
+#define DEMU_BQ_MIN_NODES 1024
+#define DEMU_BQ_MAX_NODES 65536
+#define DEMU_RED_WSHIFT 9		/* weight of the average queue, 1/512 */
+
+struct demu_bq_node {
+	struct rte_mbuf *m;
+	uint64_t time;			/* enqueued at, TSC */
+	uint32_t next;
+};
+
+/* CoDel state of a flow (RFC 8289) */
+struct demu_codel {
+	uint64_t first_above;
+	uint64_t drop_next;
+	uint32_t count;
+	uint32_t lastcount;
+	bool dropping;
+};
+
+struct demu_bq_flow {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t bytes;
+	int32_t deficit;
+	uint32_t next;			/* in the new or old flows */
+	bool active;
+	struct demu_codel codel;
+};
+
+struct demu_bq_list {
+	uint32_t head;
+	uint32_t tail;
+};
+
+struct demu_bq {
+	uint32_t nb_pkts;
+	uint64_t bytes;
+	uint32_t free_head;
+	uint32_t nb_nodes;
+	uint64_t red_avg;		/* packets, scaled by 2^DEMU_RED_WSHIFT */
+	int32_t red_count;		/* packets since the last RED drop */
+	struct demu_bq_list new_flows;
+	struct demu_bq_list old_flows;
+	struct demu_bq_node *nodes;
+	struct demu_bq_flow flows[DEMU_FQ_FLOWS];
+} __rte_cache_aligned;
+
+static struct demu_bq *
+demu_bq_create(uint32_t nb_nodes, int socket_id)
+{
+	struct demu_bq *bq;
+	uint32_t i;
+
+	bq = rte_zmalloc_socket("demu_bq", sizeof(*bq), RTE_CACHE_LINE_SIZE, socket_id);
+	if (bq == NULL)
+		return NULL;
+	bq->nodes = rte_malloc_socket("demu_bq_nodes", sizeof(*bq->nodes) * nb_nodes,
+			RTE_CACHE_LINE_SIZE, socket_id);
+	if (bq->nodes == NULL) {
+		rte_free(bq);
+		return NULL;
+	}
+
+	for (i = 0; i < nb_nodes; i++)
+		bq->nodes[i].next = i + 1;
+	bq->nodes[nb_nodes - 1].next = DEMU_BQ_NIL;
+	bq->nb_nodes = nb_nodes;
+	bq->red_count = -1;
+	bq->new_flows.head = bq->new_flows.tail = DEMU_BQ_NIL;
+	bq->old_flows.head = bq->old_flows.tail = DEMU_BQ_NIL;
+	for (i = 0; i < DEMU_FQ_FLOWS; i++)
+		bq->flows[i].head = bq->flows[i].tail = DEMU_BQ_NIL;
+
+	return bq;
+}
+
+static inline void
+demu_bq_list_push(struct demu_bq *bq, struct demu_bq_list *list, uint32_t f)
+{
+	bq->flows[f].next = DEMU_BQ_NIL;
+	if (list->head == DEMU_BQ_NIL)
+		list->head = f;
+	else
+		bq->flows[list->tail].next = f;
+	list->tail = f;
+}
+
+static inline void
+demu_bq_list_pop(struct demu_bq *bq, struct demu_bq_list *list)
+{
+	list->head = bq->flows[list->head].next;
+}
+
+/* Append m to flow f; the caller checked that a node is free */
+static inline void
+demu_bq_push(struct demu_bq *bq, uint32_t f, struct rte_mbuf *m, uint64_t now)
+{
+	struct demu_bq_flow *flow = &bq->flows[f];
+	uint32_t n = bq->free_head;
+
+	bq->free_head = bq->nodes[n].next;
+	bq->nodes[n].m = m;
+	bq->nodes[n].time = now;
+	bq->nodes[n].next = DEMU_BQ_NIL;
+	if (flow->head == DEMU_BQ_NIL)
+		flow->head = n;
+	else
+		bq->nodes[flow->tail].next = n;
+	flow->tail = n;
+	flow->bytes += m->pkt_len;
+	bq->nb_pkts++;
+	bq->bytes += m->pkt_len;
+
+	if (!flow->active) {
+		flow->active = true;
+		flow->deficit = DEMU_FQ_QUANTUM;
+		demu_bq_list_push(bq, &bq->new_flows, f);
+	}
+}
+
+/* Remove the head of flow f, or return NULL if it is empty */
+static inline struct rte_mbuf *
+demu_bq_pop(struct demu_bq *bq, uint32_t f, uint64_t *time)
+{
+	struct demu_bq_flow *flow = &bq->flows[f];
+	uint32_t n = flow->head;
+	struct rte_mbuf *m;
+
+	if (n == DEMU_BQ_NIL)
+		return NULL;
+	m = bq->nodes[n].m;
+	*time = bq->nodes[n].time;
+	flow->head = bq->nodes[n].next;
+	bq->nodes[n].next = bq->free_head;
+	bq->free_head = n;
+	flow->bytes -= m->pkt_len;
+	bq->nb_pkts--;
+	bq->bytes -= m->pkt_len;
+
+	return m;
+}
+
+/*
+ * Set the CE codepoint of an ECN capable IPv4 or IPv6 packet, updating
+ * the IPv4 checksum incrementally as Linux does. Returns false if the
+ * packet is not ECN capable, and has to be dropped instead.
+ */
+static inline bool
+demu_ecn_mark(struct rte_mbuf *m)
+{
+	struct ether_hdr *eth = rte_pktmbuf_mtod(m, struct ether_hdr *);
+
+	if (eth->ether_type == rte_cpu_to_be_16(ETHER_TYPE_IPv4)) {
+		struct ipv4_hdr *ip = (struct ipv4_hdr *)(eth + 1);
+		uint32_t check = ip->hdr_checksum;
+		uint8_t ecn = (ip->type_of_service + 1) & 3;
+
+		if ((ip->type_of_service & 3) == 0)
+			return false;
+		if (ecn == 0)		/* already CE */
+			return true;
+		check += rte_cpu_to_be_16(0xfffb) + rte_cpu_to_be_16(ecn);
+		ip->hdr_checksum = check + (check >= 0xffff);
+		ip->type_of_service |= 3;
+		return true;
+	}
+	if (eth->ether_type == rte_cpu_to_be_16(ETHER_TYPE_IPv6)) {
+		struct ipv6_hdr *ip6 = (struct ipv6_hdr *)(eth + 1);
+		uint32_t vtc = rte_be_to_cpu_32(ip6->vtc_flow);
+
+		if (((vtc >> 20) & 3) == 0)
+			return false;
+		ip6->vtc_flow = rte_cpu_to_be_32(vtc | (3 << 20));
+		return true;
+	}
+
+	return false;
+}
+
+/* Flow of m for FQ-CoDel: the RSS hash, or a hash of the IPv4 5-tuple */
+static inline uint32_t
+demu_flow_hash(struct rte_mbuf *m)
+{
+	struct ether_hdr *eth;
+	struct ipv4_hdr *ip;
+	uint32_t ports = 0, ihl;
+
+	if (m->ol_flags & PKT_RX_RSS_HASH)
+		return m->hash.rss;
+
+	eth = rte_pktmbuf_mtod(m, struct ether_hdr *);
+	if (eth->ether_type != rte_cpu_to_be_16(ETHER_TYPE_IPv4) ||
+			m->data_len < sizeof(*eth) + sizeof(*ip))
+		return 0;
+	ip = (struct ipv4_hdr *)(eth + 1);
+	ihl = (ip->version_ihl & 0xf) * 4;
+	if (ihl < sizeof(*ip))
+		return 0;
+	/* only the first fragment has the ports */
+	if ((ip->next_proto_id == IPPROTO_TCP || ip->next_proto_id == IPPROTO_UDP) &&
+			m->data_len >= sizeof(*eth) + ihl + 4 &&
+			!(ip->fragment_offset & rte_cpu_to_be_16(IPV4_HDR_OFFSET_MASK)))
+		ports = *(const unaligned_uint32_t *)((uint8_t *)ip + ihl);
+
+	return rte_jhash_3words(ip->src_addr, ip->dst_addr,
+			ports ^ ip->next_proto_id, 0);
+}
+
+/* Limits of one TX queue's share of the queue of p */
+static inline uint32_t
+demu_bq_limit(const struct demu_link_params *p)
+{
+	return p->queue_limit ? RTE_MAX(p->queue_limit / nb_queues, 1U) : UINT32_MAX;
+}
+
+static inline uint64_t
+demu_bq_limit_bytes(const struct demu_link_params *p)
+{
+	return p->queue_limit_bytes ?
+		RTE_MAX(p->queue_limit_bytes / nb_queues, (uint64_t)DEMU_FQ_QUANTUM) : UINT64_MAX;
+}
+
+/*
+ * RED (Floyd and Jacobson): drop with a probability that grows with the
+ * average queue length between red_min and red_max, spread out by the
+ * number of packets since the last drop.
+ */
+static inline bool
+demu_red_drop(struct demu_bq *bq, const struct demu_link_params *p, struct demu_rand *rs)
+{
+	uint32_t limit = demu_bq_limit(p);
+	uint32_t min, max;
+	double avg, pb, pa;
+
+	if (limit == UINT32_MAX)
+		limit = RTE_MIN(demu_bq_limit_bytes(p) / DEMU_FQ_QUANTUM, (uint64_t)bq->nb_nodes);
+	min = p->red_min ? RTE_MAX(p->red_min / nb_queues, 1U) : limit / 4;
+	max = p->red_max ? RTE_MAX(p->red_max / nb_queues, min + 1) : limit * 3 / 4;
+
+	bq->red_avg += bq->nb_pkts - (bq->red_avg >> DEMU_RED_WSHIFT);
+	avg = (double)bq->red_avg / (1 << DEMU_RED_WSHIFT);
+	if (avg < min) {
+		bq->red_count = -1;
+		return false;
+	}
+	if (avg >= max) {
+		bq->red_count = 0;
+		return true;
+	}
+
+	bq->red_count++;
+	pb = (double)p->red_prob / UINT32_MAX * (avg - min) / (max - min);
+	pa = bq->red_count * pb < 1 ? pb / (1 - bq->red_count * pb) : 1;
+	if (demu_rand_get(rs) >= pa * UINT32_MAX)
+		return false;
+	bq->red_count = 0;
+	return true;
+}
+
+/* Drop up to DEMU_FQ_DROP_BATCH packets from the head of the fattest flow */
+static void
+demu_fq_drop(struct demu_bq *bq, struct demu_task_stats *stats)
+{
+	uint32_t fat = 0, threshold;
+	struct rte_mbuf *m;
+	uint64_t time;
+
+	for (uint32_t f = 1; f < DEMU_FQ_FLOWS; f++)
+		if (bq->flows[f].bytes > bq->flows[fat].bytes)
+			fat = f;
+
+	threshold = bq->flows[fat].bytes / 2;
+	for (int i = 0; i < DEMU_FQ_DROP_BATCH && bq->flows[fat].bytes > threshold; i++) {
+		m = demu_bq_pop(bq, fat, &time);
+		rte_pktmbuf_free(m);
+		stats->queue_dropped++;
+	}
+}
+
+/* Queue m, received from the delay line at now, or drop it */
+static inline void
+demu_bq_enqueue(struct demu_bq *bq, const struct demu_link_params *p,
+		struct rte_mbuf *m, uint64_t now, struct demu_rand *rs,
+		struct demu_task_stats *stats)
+{
+	uint32_t f = 0;
+
+	if (p->aqm == DEMU_AQM_RED && demu_red_drop(bq, p, rs)) {
+		if (!p->ecn || !demu_ecn_mark(m)) {
+			rte_pktmbuf_free(m);
+			stats->queue_dropped++;
+			return;
+		}
+		stats->ecn_marked++;
+	}
+
+	if (p->aqm == DEMU_AQM_FQ_CODEL) {
+		/* make room at the expense of the flow with the largest backlog */
+		f = demu_flow_hash(m) % DEMU_FQ_FLOWS;
+		if (bq->free_head == DEMU_BQ_NIL)
+			demu_fq_drop(bq, stats);
+		demu_bq_push(bq, f, m, now);
+		if (bq->nb_pkts > demu_bq_limit(p) || bq->bytes > demu_bq_limit_bytes(p))
+			demu_fq_drop(bq, stats);
+		return;
+	}
+
+	if (bq->free_head == DEMU_BQ_NIL || bq->nb_pkts >= demu_bq_limit(p) ||
+			bq->bytes + m->pkt_len > demu_bq_limit_bytes(p)) {
+		rte_pktmbuf_free(m);
+		stats->queue_dropped++;
+		return;
+	}
+	demu_bq_push(bq, f, m, now);
+}
+
+static inline uint64_t
+demu_codel_control_law(uint64_t t, const struct demu_link_params *p, uint32_t count)
+{
+	return t + (uint64_t)(p->aqm_interval / sqrt(count));
+}
+
+/* Pop the head of flow f and tell whether its sojourn time allows a drop */
+static inline struct rte_mbuf *
+demu_codel_pop(struct demu_bq *bq, uint32_t f, const struct demu_link_params *p,
+		uint64_t now, bool *ok_to_drop)
+{
+	struct demu_codel *c = &bq->flows[f].codel;
+	struct rte_mbuf *m;
+	uint64_t time;
+
+	*ok_to_drop = false;
+	m = demu_bq_pop(bq, f, &time);
+	if (m == NULL) {
+		c->first_above = 0;
+		return NULL;
+	}
+
+	if (now - time < p->aqm_target || bq->flows[f].bytes <= DEMU_FQ_QUANTUM)
+		c->first_above = 0;
+	else if (c->first_above == 0)
+		c->first_above = now + p->aqm_interval;
+	else if (now >= c->first_above)
+		*ok_to_drop = true;
+
+	return m;
+}
+
+/* Dequeue from flow f with the CoDel state machine of RFC 8289 */
+static inline struct rte_mbuf *
+demu_codel_dequeue(struct demu_bq *bq, uint32_t f, const struct demu_link_params *p,
+		uint64_t now, struct demu_task_stats *stats)
+{
+	struct demu_codel *c = &bq->flows[f].codel;
+	struct rte_mbuf *m;
+	bool ok_to_drop;
+	uint32_t delta;
+
+	m = demu_codel_pop(bq, f, p, now, &ok_to_drop);
+	if (m == NULL) {
+		c->dropping = false;
+		return NULL;
+	}
+
+	if (c->dropping) {
+		if (!ok_to_drop)
+			c->dropping = false;
+		while (c->dropping && now >= c->drop_next) {
+			c->count++;
+			if (p->ecn && demu_ecn_mark(m)) {
+				stats->ecn_marked++;
+				c->drop_next = demu_codel_control_law(c->drop_next, p, c->count);
+				return m;
+			}
+			rte_pktmbuf_free(m);
+			stats->queue_dropped++;
+			m = demu_codel_pop(bq, f, p, now, &ok_to_drop);
+			if (!ok_to_drop)
+				c->dropping = false;
+			else
+				c->drop_next = demu_codel_control_law(c->drop_next, p, c->count);
+		}
+	} else if (ok_to_drop) {
+		delta = c->count - c->lastcount;
+		c->dropping = true;
+		c->count = (delta > 1 && now - c->drop_next < 16 * p->aqm_interval) ? delta : 1;
+		c->lastcount = c->count;
+		c->drop_next = demu_codel_control_law(now, p, c->count);
+		if (p->ecn && demu_ecn_mark(m)) {
+			stats->ecn_marked++;
+			return m;
+		}
+		rte_pktmbuf_free(m);
+		stats->queue_dropped++;
+		m = demu_codel_pop(bq, f, p, now, &ok_to_drop);
+	}
+
+	return m;
+}
+
+/* Next packet to send, or NULL if the queue is empty */
+static inline struct rte_mbuf *
+demu_bq_dequeue(struct demu_bq *bq, const struct demu_link_params *p,
+		uint64_t now, struct demu_task_stats *stats)
+{
+	bool codel = p->aqm == DEMU_AQM_CODEL || p->aqm == DEMU_AQM_FQ_CODEL;
+	struct demu_bq_list *list;
+	struct demu_bq_flow *flow;
+	struct rte_mbuf *m;
+	uint64_t time;
+	uint32_t f;
+
+	for (;;) {
+		list = &bq->new_flows;
+		if (list->head == DEMU_BQ_NIL) {
+			list = &bq->old_flows;
+			if (list->head == DEMU_BQ_NIL)
+				return NULL;
+		}
+		f = list->head;
+		flow = &bq->flows[f];
+
+		if (flow->deficit <= 0) {
+			flow->deficit += DEMU_FQ_QUANTUM;
+			demu_bq_list_pop(bq, list);
+			demu_bq_list_push(bq, &bq->old_flows, f);
+			continue;
+		}
+
+		if (codel)
+			m = demu_codel_dequeue(bq, f, p, now, stats);
+		else
+			m = demu_bq_pop(bq, f, &time);
+		if (m == NULL) {
+			/* a new flow that empties gets one more round as an old one */
+			demu_bq_list_pop(bq, list);
+			if (list == &bq->new_flows && bq->old_flows.head != DEMU_BQ_NIL)
+				demu_bq_list_push(bq, &bq->old_flows, f);
+			else
+				flow->active = false;
+			continue;
+		}
+
+		flow->deficit -= m->pkt_len;
+		return m;
+	}
+}
+
+/*
+ * Packet capture.
+ *
+ * With --capture, each RX task taps the packets it receives, with the
+ * verdict of the impairments, and each TX task the packets it sends. A
+ * tap takes a reference to the mbuf and hands it, with its time and
+ * verdict, over an SPSC ring of its own to the capture writer task, which
+ * writes pcapng and releases the mbuf. So RX and TX neither copy packets
+ * nor touch the file; what does not fit in the ring of a tap is not
+ * captured, and counted. A packet corrupted by RX is captured corrupted,
+ * and one marked CE by TX may be captured marked at RX.
+ */
+#define DEMU_CAP_RING_SIZE 8192
+#define DEMU_CAP_WRITE_BURST 256
+#define DEMU_CAP_NIL UINT32_MAX
+#define DEMU_CAP_TSC_MASK ((1ULL << 56) - 1)	/* cycles since the start */
+#define DEMU_CAP_VERDICT_SHIFT 56
+#define DEMU_CAP_VERDICT_MASK (0x7fULL << DEMU_CAP_VERDICT_SHIFT)
+#define DEMU_CAP_OUT (1ULL << 63)		/* sent, else received */
+
+#define DEMU_PCAPNG_SHB 0x0A0D0D0A
+#define DEMU_PCAPNG_IDB 0x00000001
+#define DEMU_PCAPNG_EPB 0x00000006
+#define DEMU_PCAPNG_MAGIC 0x1A2B3C4D
+#define DEMU_PCAPNG_LINKTYPE_ETHERNET 1
+#define DEMU_PCAPNG_OPT_END 0
+#define DEMU_PCAPNG_OPT_COMMENT 1
+#define DEMU_PCAPNG_SHB_USERAPPL 4
+#define DEMU_PCAPNG_IF_NAME 2
+#define DEMU_PCAPNG_IF_TSRESOL 9
+#define DEMU_PCAPNG_EPB_FLAGS 2
+#define DEMU_PCAPNG_MAX_OPTS 64
+
+enum demu_cap_verdict {
+	DEMU_CAP_PASS = 0,
+	DEMU_CAP_LOSS,
+	DEMU_CAP_SHAPING,
+	DEMU_CAP_OVERFLOW,
+	DEMU_CAP_DUP,
+	DEMU_CAP_CORRUPT,
+};
+
+/* The comment of the packets of each verdict */
+static const char *const demu_cap_verdict_names[] = {
+	[DEMU_CAP_PASS] = NULL,
+	[DEMU_CAP_LOSS] = "loss",
+	[DEMU_CAP_SHAPING] = "shaping",
+	[DEMU_CAP_OVERFLOW] = "overflow",
+	[DEMU_CAP_DUP] = "dup",
+	[DEMU_CAP_CORRUPT] = "corrupt",
+};
+
+static const char *demu_cap_path;
+static uint32_t demu_cap_snaplen = UINT16_MAX;
+static uint32_t demu_cap_sample = 1;	/* capture the packets of 1 flow in N */
+static FILE *demu_cap_file;
+static uint64_t demu_cap_start;		/* TSC the capture times count from */
+static uint64_t demu_cap_start_ns;	/* UTC time of demu_cap_start, ns */
+static uint8_t *demu_cap_buf;		/* block being written */
+
+static inline uint64_t
+demu_cap_meta(uint64_t now, enum demu_cap_verdict verdict, bool out)
+{
+	return ((now - demu_cap_start) & DEMU_CAP_TSC_MASK) |
+		(uint64_t)verdict << DEMU_CAP_VERDICT_SHIFT | (out ? DEMU_CAP_OUT : 0);
+}
+
+/*
+ * Capture m in the burst of the task, unless its flow is not sampled.
+ * Returns where it is in the burst, or DEMU_CAP_NIL.
+ */
+static inline uint32_t
+demu_cap_tap(struct demu_scratch *s, struct rte_mbuf *m, uint64_t meta)
+{
+	if (demu_cap_sample > 1 && demu_flow_hash(m) % demu_cap_sample)
+		return DEMU_CAP_NIL;
+	for (struct rte_mbuf *seg = m; seg != NULL; seg = seg->next)
+		rte_mbuf_refcnt_update(seg, 1);
+	s->cap_pkts[s->nb_cap] = m;
+	s->cap_meta[s->nb_cap] = meta;
+
+	return s->nb_cap++;
+}
+
+/* Change the verdict of the packet captured at idx of the burst */
+static inline void
+demu_cap_verdict(struct demu_scratch *s, uint32_t idx, enum demu_cap_verdict verdict)
+{
+	if (idx == DEMU_CAP_NIL)
+		return;
+	s->cap_meta[idx] = (s->cap_meta[idx] & ~DEMU_CAP_VERDICT_MASK) |
+		(uint64_t)verdict << DEMU_CAP_VERDICT_SHIFT;
+}
+
+/* Hand the packets captured in the burst of t over to the writer */
+static inline void
+demu_cap_flush(struct demu_task *t, struct demu_scratch *s)
+{
+	unsigned n;
+
+	if (s->nb_cap == 0)
+		return;
+	n = demu_dq_enqueue_burst(t->cap, s->cap_pkts, s->cap_meta, s->nb_cap);
+	if (unlikely(n < s->nb_cap)) {
+		t->stats->cap_missed += s->nb_cap - n;
+		pktmbuf_free_bulk(s->cap_pkts + n, s->nb_cap - n);
+	}
+	s->nb_cap = 0;
+}
+
+/* Append the option code of len bytes at p, padded to 32 bits */
+static uint8_t *
+demu_cap_opt(uint8_t *p, uint16_t code, const void *value, uint16_t len)
+{
+	memcpy(p, &code, sizeof(code));
+	memcpy(p + 2, &len, sizeof(len));
+	memcpy(p + 4, value, len);
+	memset(p + 4 + len, 0, RTE_ALIGN(len, 4) - len);
+
+	return p + 4 + RTE_ALIGN(len, 4);
+}
+
+/* Write the block of type in demu_cap_buf, whose body ends at end */
+static void
+demu_cap_block(uint32_t type, uint8_t *end)
+{
+	uint32_t len = end - demu_cap_buf + sizeof(len);
+
+	memcpy(demu_cap_buf, &type, sizeof(type));
+	memcpy(demu_cap_buf + 4, &len, sizeof(len));
+	memcpy(end, &len, sizeof(len));
+	fwrite(demu_cap_buf, len, 1, demu_cap_file);
+}
+
+/* Write m, captured on port index i with meta, as an enhanced packet block */
+static void
+demu_cap_write(uint8_t i, struct rte_mbuf *m, uint64_t meta)
+{
+	uint64_t hz = rte_get_tsc_hz(), tsc = meta & DEMU_CAP_TSC_MASK;
+	uint64_t ns = demu_cap_start_ns + tsc / hz * NS_PER_S + tsc % hz * NS_PER_S / hz;
+	uint32_t caplen = RTE_MIN(m->pkt_len, demu_cap_snaplen);
+	uint32_t hdr[5] = {i, ns >> 32, (uint32_t)ns, caplen, m->pkt_len};
+	uint32_t flags = meta & DEMU_CAP_OUT ? 2 : 1;	/* outbound or inbound */
+	const char *verdict = demu_cap_verdict_names[(meta & DEMU_CAP_VERDICT_MASK) >>
+		DEMU_CAP_VERDICT_SHIFT];
+	uint8_t *p = demu_cap_buf + 8;
+
+	memcpy(p, hdr, sizeof(hdr));
+	p += sizeof(hdr);
+	for (uint32_t off = 0; m != NULL && off < caplen; m = m->next) {
+		uint32_t len = RTE_MIN((uint32_t)m->data_len, caplen - off);
+
+		rte_memcpy(p + off, rte_pktmbuf_mtod(m, void *), len);
+		off += len;
+	}
+	memset(p + caplen, 0, RTE_ALIGN(caplen, 4) - caplen);
+	p += RTE_ALIGN(caplen, 4);
+
+	p = demu_cap_opt(p, DEMU_PCAPNG_EPB_FLAGS, &flags, sizeof(flags));
+	if (verdict != NULL)
+		p = demu_cap_opt(p, DEMU_PCAPNG_OPT_COMMENT, verdict, strlen(verdict));
+	p = demu_cap_opt(p, DEMU_PCAPNG_OPT_END, NULL, 0);
+	demu_cap_block(DEMU_PCAPNG_EPB, p);
+}
+
+/*
+ * Open the capture file, with an interface per port. The times of the
+ * packets are in ns.
+ */
+static int
+demu_cap_open(void)
+{
+	static const char userappl[] = "DEMU";
+	static const uint8_t tsresol = 9;
+	struct timespec ts;
+	char name[32];
+	uint8_t *p;
+
+	demu_cap_buf = rte_malloc("demu_cap_buf", 8 + 20 + RTE_ALIGN(demu_cap_snaplen, 4) +
+			DEMU_PCAPNG_MAX_OPTS + 4, 0);
+	if (demu_cap_buf == NULL)
+		return -1;
+	demu_cap_file = fopen(demu_cap_path, "w");
+	if (demu_cap_file == NULL)
+		return -1;
+	setvbuf(demu_cap_file, NULL, _IOFBF, 1 << 20);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	demu_cap_start = rte_rdtsc();
+	demu_cap_start_ns = (uint64_t)ts.tv_sec * NS_PER_S + ts.tv_nsec;
+
+	p = demu_cap_buf + 8;
+	*(uint32_t *)p = DEMU_PCAPNG_MAGIC;
+	*(uint16_t *)(p + 4) = 1;		/* version 1.0 */
+	*(uint16_t *)(p + 6) = 0;
+	*(int64_t *)(p + 8) = -1;		/* section length not known */
+	p = demu_cap_opt(p + 16, DEMU_PCAPNG_SHB_USERAPPL, userappl, strlen(userappl));
+	p = demu_cap_opt(p, DEMU_PCAPNG_OPT_END, NULL, 0);
+	demu_cap_block(DEMU_PCAPNG_SHB, p);
+
+	for (int i = 0; i < nb_ports; i++) {
+		p = demu_cap_buf + 8;
+		*(uint16_t *)p = DEMU_PCAPNG_LINKTYPE_ETHERNET;
+		*(uint16_t *)(p + 2) = 0;
+		*(uint32_t *)(p + 4) = demu_cap_snaplen;
+		snprintf(name, sizeof(name), "port%u", ports[i].portid);
+		p = demu_cap_opt(p + 8, DEMU_PCAPNG_IF_NAME, name, strlen(name));
+		p = demu_cap_opt(p, DEMU_PCAPNG_IF_TSRESOL, &tsresol, sizeof(tsresol));
+		p = demu_cap_opt(p, DEMU_PCAPNG_OPT_END, NULL, 0);
+		demu_cap_block(DEMU_PCAPNG_IDB, p);
+	}
+
+	return ferror(demu_cap_file) ? -1 : 0;
+}
+
+/* Write a burst of what each tap captured, and return how many packets */
+static unsigned
+demu_cap_drain(void)
+{
+	struct rte_mbuf *pkts[DEMU_CAP_WRITE_BURST];
+	uint64_t meta[DEMU_CAP_WRITE_BURST];
+	unsigned total = 0;
+
+	for (unsigned i = 0; i < demu_nb_tasks; i++) {
+		struct demu_task *t = &demu_tasks[i];
+		unsigned n;
+
+		if (t->cap == NULL)
+			continue;
+		n = demu_dq_dequeue_burst(t->cap, pkts, meta, DEMU_CAP_WRITE_BURST);
+		for (unsigned k = 0; k < n; k++)
+			demu_cap_write(t->port_idx, pkts[k], meta[k]);
+		pktmbuf_free_bulk(pkts, n);
+		total += n;
+	}
+
+	return total;
+}
+
+/* The writer always polls, like the timer */
+static bool
+demu_cap_poll(void)
+{
+	demu_cap_drain();
+
+	return true;
+}
+
+/* Write what is left in the rings of the taps, once the lcores have stopped */
+static void
+demu_cap_close(void)
+{
+	while (demu_cap_drain() != 0)
+		;
+	if (fclose(demu_cap_file) != 0)
+		RTE_LOG(ERR, DEMU, "Cannot write capture %s\n", demu_cap_path);
+}
+
+/*
+ * Send what pipeline queue of each source of port has released, through
+ * the bottleneck queue and rate of its path. Busy until the rings and the
+ * bottleneck queues are empty; *until is lowered to when the workers of
+ * the sources release next otherwise.
+ */
+static bool
+demu_tx_poll(struct demu_task *t, unsigned lcore_id, struct demu_scratch *scratch,
+		uint64_t *until)
+{
+	struct port_t *port = &ports[t->port_idx];
+	uint16_t queue = t->queue;
+	struct rte_mbuf **send_buf = scratch->tx.send_buf;
+	uint64_t *send_deadline = scratch->tx.send_deadline;
+	uint32_t numdeq = 0, credit;
+	uint16_t sent;
+	uint32_t num_send = 0;
+	int64_t token, token_used;
+	uint64_t now;
+	unsigned src;
+	struct demu_link *link;
+	struct demu_dq *ring;
+	struct demu_bq *bq;
+	const struct demu_link_params *p;
+	struct rte_mbuf *m;
+	bool shaped;
+	struct demu_rand *rs = &demu_rand_state[lcore_id];
+	struct demu_task_stats *stats = t->stats;
+	struct demu_hist *hist = t->hist;
+	bool busy = false;
+
+	for (unsigned s = 0; s < port->nb_tx_src; s++) {
+		src = port->tx_src[s];
+		link = demu_links[src].path[port - ports];
+		ring = port->workers_to_tx[src][queue];
+		bq = port->bq[src][queue];
+		p = demu_link_params_get(link);
+		shaped = link->trace != NULL || p->limit_speed;
+
+		/*
+		 * Take no more than the bottleneck queue has nodes for:
+		 * the rest waits in the ring, and then in the delay line,
+		 * so a packet is only dropped by the limits of the queue.
+		 */
+		credit = PKT_BURST_TX;
+		if (shaped || bq->nb_pkts)
+			credit = RTE_MIN(credit, bq->nb_nodes - bq->nb_pkts);
+		numdeq = demu_dq_dequeue_burst(ring, send_buf, send_deadline, credit);
+		busy |= numdeq || bq->nb_pkts;
+		*until = RTE_MIN(*until, __atomic_load_n(&ports[src].release_next[queue].tsc,
+					__ATOMIC_RELAXED));
+
+		/* the queue drains at full speed if the rate is removed */
+		if (!shaped && bq->nb_pkts == 0) {
+			if (unlikely(numdeq == 0))
+				continue;
+			rte_prefetch0(rte_pktmbuf_mtod(send_buf[0], void *));
+			demu_hist_record(hist, send_deadline, numdeq, rte_rdtsc());
+			num_send = numdeq;
+		} else {
+			now = rte_rdtsc();
+			/* the delay error is measured when leaving the delay line */
+			demu_hist_record(hist, send_deadline, numdeq, now);
+			for (uint32_t j = 0; j < numdeq; j++)
+				demu_bq_enqueue(bq, p, send_buf[j], now, rs, stats);
+			if (bq->nb_pkts == 0)
+				continue;
+
+			/*
+			 * Send while there are tokens. The last packet may take
+			 * more than what is left, the debt is paid by the next
+			 * tokens of the timer.
+			 */
+			token = shaped ? rte_atomic64_read(&link->amount_token) : INT64_MAX;
+			token_used = 0;
+			num_send = 0;
+			while (token_used < token && num_send < PKT_BURST_TX) {
+				m = demu_bq_dequeue(bq, p, now, stats);
+				if (m == NULL)
+					break;
+				send_buf[num_send++] = m;
+				token_used += m->pkt_len * 8;
+			}
+			if (shaped && token_used)
+				rte_atomic64_sub(&link->amount_token, token_used);
+			if (num_send == 0)
+				continue;
+			rte_prefetch0(rte_pktmbuf_mtod(send_buf[0], void *));
+		}
+
+		if (unlikely(t->cap != NULL)) {
+			uint64_t meta = demu_cap_meta(rte_rdtsc(), DEMU_CAP_PASS, true);
+
+			for (uint32_t j = 0; j < num_send; j++)
+				demu_cap_tap(scratch, send_buf[j], meta);
+			demu_cap_flush(t, scratch);
+		}
+		sent = rte_eth_tx_burst(port->portid, queue, send_buf, num_send);
+		while (num_send > sent) {
+			stats->tx_retry++;
+			sent += rte_eth_tx_burst(port->portid, queue, send_buf + sent, num_send - sent);
+		}
+		stats->tx += sent;
+	}
+
+	return busy;
+}
+
+/*
+ * Delay jitter.
+ *
+ * The jitter of a packet is looked up in an inverse CDF table of the
+ * selected distribution, in the format of the netem tables of iproute2:
+ * signed samples of a zero-mean variate with unit deviation, scaled by
+ * DEMU_DIST_SCALE. A uniform 32-bit random number picks the entry, so a
+ * sample costs a multiply, a load and a shift on the RX path.
+ * For the uniform distribution the jitter is the half-width of the range,
+ * for the others it is the standard deviation.
+ */
+#define DEMU_DIST_SCALE 8192
+#define DEMU_DIST_SHIFT 13
+#define DEMU_DIST_SIZE 4096
+#define DEMU_DIST_MAX_SIZE 65536
+
+static const char *jitter_dist = "uniform";
+static int16_t *jitter_table;
+static uint32_t jitter_table_size;
+
+/* Inverse CDF of the standard normal distribution (P. J. Acklam). */
+static double
+demu_dist_normal_icdf(double p)
+{
+	static const double a[] = {
+		-3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02,
+		1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00 };
+	static const double b[] = {
+		-5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02,
+		6.680131188771972e+01, -1.328068155288572e+01 };
+	static const double c[] = {
+		-7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00,
+		-2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00 };
+	static const double d[] = {
+		7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00,
+		3.754408661907416e+00 };
+	double q, r;
+
+	if (p < 0.02425) {
+		q = sqrt(-2 * log(p));
+		return (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) /
+			((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+	}
+	if (p > 1 - 0.02425) {
+		q = sqrt(-2 * log(1 - p));
+		return -(((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) /
+			((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+	}
+	q = p - 0.5;
+	r = q * q;
+	return (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q /
+		(((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
+}
+
+/* Inverse CDF of the shifted pareto distribution used by netem (a = 3). */
+static double
+demu_dist_pareto_icdf(double p)
+{
+	return (pow(1 - p, -1.0 / 3.0) - 1.5) * 4.0 / 3.0;
+}
+
+static int
+demu_dist_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static int16_t
+demu_dist_scale(double x)
+{
+	x *= DEMU_DIST_SCALE;
+	if (x > INT16_MAX)
+		return INT16_MAX;
+	if (x < INT16_MIN)
+		return INT16_MIN;
+	return (int16_t)lrint(x);
+}
+
+/*
+ * Load a user supplied table: whitespace separated integers scaled by
+ * DEMU_DIST_SCALE and sorted in ascending order, as produced by the
+ * maketable tool of iproute2. Lines starting with '#' are comments.
+ */
+static int
+demu_dist_load(const char *path, int16_t *table)
+{
+	FILE *fp;
+	char line[1024];
+	char *p, *end;
+	long v;
+	int n = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#')
+			continue;
+		for (p = line; ; p = end) {
+			v = strtol(p, &end, 0);
+			if (end == p)
+				break;
+			if (n == DEMU_DIST_MAX_SIZE || v < INT16_MIN || v > INT16_MAX) {
+				fclose(fp);
+				return -1;
+			}
+			table[n++] = (int16_t)v;
+		}
+	}
+	fclose(fp);
+
+	return n;
+}
+
+/* Build jitter_table for the distribution named by jitter_dist. */
+static int
+demu_dist_init(void)
+{
+	int16_t *table;
+	double *samples;
+	int n, i;
+
+	table = rte_malloc("demu_jitter_table",
+			sizeof(*table) * DEMU_DIST_MAX_SIZE, RTE_CACHE_LINE_SIZE);
+	if (table == NULL)
+		return -1;
+
+	n = DEMU_DIST_SIZE;
+	if (!strcmp(jitter_dist, "uniform")) {
+		for (i = 0; i < n; i++)
+			table[i] = demu_dist_scale((2.0 * i + 1) / n - 1);
+	} else if (!strcmp(jitter_dist, "normal")) {
+		for (i = 0; i < n; i++)
+			table[i] = demu_dist_scale(demu_dist_normal_icdf((i + 0.5) / n));
+	} else if (!strcmp(jitter_dist, "pareto")) {
+		for (i = 0; i < n; i++)
+			table[i] = demu_dist_scale(demu_dist_pareto_icdf((i + 0.5) / n));
+	} else if (!strcmp(jitter_dist, "paretonormal")) {
+		/*
+		 * Like iproute2, mix 1/4 normal and 3/4 pareto variates and
+		 * take the quantiles of the sorted samples.
+		 */
+#define DEMU_DIST_MIX_SAMPLES 64
+		samples = malloc(sizeof(*samples) * n * DEMU_DIST_MIX_SAMPLES);
+		if (samples == NULL) {
+			rte_free(table);
+			return -1;
+		}
+		for (i = 0; i < n * DEMU_DIST_MIX_SAMPLES; i++)
+			samples[i] = 0.25 * demu_dist_normal_icdf(((rte_rand() >> 11) + 0.5) / (1ULL << 53)) +
+				0.75 * demu_dist_pareto_icdf(((rte_rand() >> 11) + 0.5) / (1ULL << 53));
+		qsort(samples, n * DEMU_DIST_MIX_SAMPLES, sizeof(*samples), demu_dist_cmp);
+		for (i = 0; i < n; i++)
+			table[i] = demu_dist_scale(samples[i * DEMU_DIST_MIX_SAMPLES + DEMU_DIST_MIX_SAMPLES / 2]);
+		free(samples);
+	} else {
+		n = demu_dist_load(jitter_dist, table);
+		if (n <= 0) {
+			rte_free(table);
+			return -1;
+		}
+	}
+
+	jitter_table = table;
+	jitter_table_size = n;
+
+	return 0;
+}
+
+/*
+ * Delay of the next packet in TSC cycles. With a correlation, the
+ * uniform random number is mixed with the previous one as in netem, so
+ * the delay of consecutive packets drifts instead of jumping.
+ */
+static inline uint64_t
+demu_delay_sample(struct demu_rand *rs, const struct demu_link_params *p, uint32_t *last_rnd)
+{
+	uint32_t rnd;
+	int64_t delay;
+
+	if (p->jitter_time == 0)
+		return p->delayed_time;
+
+	rnd = demu_rand_get(rs);
+	if (p->jitter_corr) {
+		rnd = ((uint64_t)rnd * (UINT32_MAX - p->jitter_corr) +
+			(uint64_t)*last_rnd * p->jitter_corr) >> 32;
+		*last_rnd = rnd;
+	}
+
+	delay = (int64_t)p->delayed_time +
+		(((int64_t)jitter_table[((uint64_t)rnd * jitter_table_size) >> 32] *
+		  (int64_t)p->jitter_time) >> DEMU_DIST_SHIFT);
+
+	return delay < 0 ? 0 : (uint64_t)delay;
+}
+
+/*
+ * Reordering as in netem: after reorder_gap - 1 delayed packets, a
+ * packet is sent without delay with probability reorder_rate, ahead of
+ * the packets still in the delay line. With a correlation, the random
+ * number is mixed with the previous one like the jitter.
+ */
+static inline bool
+demu_reorder_event(struct demu_rand *rs, const struct demu_link_params *p,
+		struct demu_link_rxq *st)
+{
+	uint32_t rnd;
+
+	if (st->reorder_cnt + 1 < p->reorder_gap) {
+		st->reorder_cnt++;
+		return false;
+	}
+
+	rnd = demu_rand_get(rs);
+	if (p->reorder_corr) {
+		rnd = ((uint64_t)rnd * (UINT32_MAX - p->reorder_corr) +
+			(uint64_t)st->reorder_rnd * p->reorder_corr) >> 32;
+		st->reorder_rnd = rnd;
+	}
+	if (rnd >= p->reorder_rate) {
+		st->reorder_cnt++;
+		return false;
+	}
+	st->reorder_cnt = 0;
+
+	return true;
+}
+
+/*
+ * TSC deadline of a packet received at now. In FIFO mode a deadline
+ * never precedes the previous one, so jitter does not reorder packets.
+ * A reordered packet is due at once and leaves the FIFO order alone.
+ */
+static inline uint64_t
+demu_deadline(struct demu_rand *rs, const struct demu_link_params *p,
+		struct demu_link_rxq *st, uint64_t now)
+{
+	uint64_t deadline;
+
+	if (unlikely(p->reorder_rate) && demu_reorder_event(rs, p, st))
+		return now;
+
+	deadline = now + demu_delay_sample(rs, p, &st->jitter_rnd);
+
+	if (p->jitter_fifo && deadline < st->last_deadline)
+		deadline = st->last_deadline;
+	st->last_deadline = deadline;
+
+	return deadline;
+}
+
+/*
+ * Classification of IPv4 packets by protocol, addresses, ports and DSCP,
+ * with an ACL trie built from the --rules file. The offsets are from the
+ * start of the IPv4 header, which is assumed to carry no options.
+ */
+enum {
+	DEMU_ACL_PROTO,
+	DEMU_ACL_SRC,
+	DEMU_ACL_DST,
+	DEMU_ACL_SPORT,
+	DEMU_ACL_DPORT,
+	DEMU_ACL_TOS,
+	DEMU_ACL_NUM_FIELDS
+};
+
+RTE_ACL_RULE_DEF(demu_acl_rule, DEMU_ACL_NUM_FIELDS);
+
+static const struct rte_acl_field_def demu_acl_defs[DEMU_ACL_NUM_FIELDS] = {
+	{
+		.type = RTE_ACL_FIELD_TYPE_BITMASK,
+		.size = sizeof(uint8_t),
+		.field_index = DEMU_ACL_PROTO,
+		.input_index = 0,
+		.offset = offsetof(struct ipv4_hdr, next_proto_id),
+	},
+	{
+		.type = RTE_ACL_FIELD_TYPE_MASK,
+		.size = sizeof(uint32_t),
+		.field_index = DEMU_ACL_SRC,
+		.input_index = 1,
+		.offset = offsetof(struct ipv4_hdr, src_addr),
+	},
+	{
+		.type = RTE_ACL_FIELD_TYPE_MASK,
+		.size = sizeof(uint32_t),
+		.field_index = DEMU_ACL_DST,
+		.input_index = 2,
+		.offset = offsetof(struct ipv4_hdr, dst_addr),
+	},
+	{
+		.type = RTE_ACL_FIELD_TYPE_RANGE,
+		.size = sizeof(uint16_t),
+		.field_index = DEMU_ACL_SPORT,
+		.input_index = 3,
+		.offset = sizeof(struct ipv4_hdr),
+	},
+	{
+		.type = RTE_ACL_FIELD_TYPE_RANGE,
+		.size = sizeof(uint16_t),
+		.field_index = DEMU_ACL_DPORT,
+		.input_index = 3,
+		.offset = sizeof(struct ipv4_hdr) + sizeof(uint16_t),
+	},
+	{
+		.type = RTE_ACL_FIELD_TYPE_BITMASK,
+		.size = sizeof(uint8_t),
+		.field_index = DEMU_ACL_TOS,
+		.input_index = 4,
+		.offset = offsetof(struct ipv4_hdr, type_of_service),
+	},
+};
+
+static struct rte_acl_ctx *demu_acl_ctx;
+
+/* Longest a class rate may hold packets back before dropping them */
+#define DEMU_CLASS_MAX_BACKLOG_US 100000
+static uint64_t demu_class_max_backlog;
+
+/*
+ * Class of each of the n packets, 0 if no rule matches. IPv4 packets
+ * with options and fragments past the first have no ports where the
+ * rules look for them, and are left in class 0.
+ */
+static inline void
+demu_classify(struct rte_mbuf **pkts, unsigned n, uint8_t *classes)
+{
+	const uint8_t *data[PKT_BURST_RX];
+	uint32_t results[PKT_BURST_RX];
+	uint16_t idx[PKT_BURST_RX];
+	unsigned nb_ip = 0, i;
+
+	for (i = 0; i < n; i++) {
+		struct ether_hdr *eth = rte_pktmbuf_mtod(pkts[i], struct ether_hdr *);
+
+		struct ipv4_hdr *ip = (struct ipv4_hdr *)(eth + 1);
+
+		classes[i] = 0;
+		if (eth->ether_type != rte_cpu_to_be_16(ETHER_TYPE_IPv4) ||
+				pkts[i]->data_len < sizeof(*eth) + sizeof(*ip) + 4)
+			continue;
+		/* the rules read the ports right after a header without options */
+		if (ip->version_ihl != 0x45 ||
+				(ip->fragment_offset & rte_cpu_to_be_16(IPV4_HDR_OFFSET_MASK)))
+			continue;
+		data[nb_ip] = (const uint8_t *)ip;
+		idx[nb_ip++] = i;
+	}
+	if (nb_ip == 0)
+		return;
+
+	rte_acl_classify(demu_acl_ctx, data, results, nb_ip, 1);
+	for (i = 0; i < nb_ip; i++)
+		classes[idx[i]] = results[i];
+}
+
+/*
+ * Serialize a packet of len bytes received at now on a class rate,
+ * shared by the RX queues of the direction. Returns when the last bit
+ * leaves the virtual queue, or 0 if the packet would wait longer than
+ * DEMU_CLASS_MAX_BACKLOG_US.
+ */
+static inline uint64_t
+demu_class_shape(rte_atomic64_t *vt, uint64_t rate, uint32_t len, uint64_t now)
+{
+	uint64_t cost = (uint64_t)len * 8 * rte_get_tsc_hz() / rate;
+	uint64_t old, start;
+
+	do {
+		old = rte_atomic64_read(vt);
+		start = RTE_MAX(old, now);
+		if (start - now > demu_class_max_backlog)
+			return 0;
+	} while (!rte_atomic64_cmpset((volatile uint64_t *)&vt->cnt, old, start + cost));
+
+	return start + cost;
+}
+
+/*
+ * Bit errors.
+ *
+ * With a bit error rate, a frame of len bytes is hit with probability
+ * 1 - (1 - ber)^(8 * len), looked up in a table by length so that the
+ * RX path only draws one random number per packet. The tables are built
+ * by the control path for each BER in use and never freed, so the
+ * parameters can share them across copies.
+ */
+#define DEMU_BER_MAX_LEN 16384
+#define DEMU_BER_MAX_TABLES 64
+
+struct demu_ber_table {
+	double ber;
+	uint32_t prob[DEMU_BER_MAX_LEN];
+};
+
+static struct demu_ber_table *demu_ber_tables[DEMU_BER_MAX_TABLES];
+static pthread_mutex_t demu_ber_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Table of ber, built if needed, or NULL if there are too many */
+static const uint32_t *
+demu_ber_table_get(double ber)
+{
+	struct demu_ber_table *t = NULL;
+	double lp = log1p(-ber);
+	int i;
+
+	pthread_mutex_lock(&demu_ber_lock);
+	for (i = 0; i < DEMU_BER_MAX_TABLES && demu_ber_tables[i] != NULL; i++)
+		if (demu_ber_tables[i]->ber == ber) {
+			t = demu_ber_tables[i];
+			goto out;
+		}
+	if (i == DEMU_BER_MAX_TABLES)
+		goto out;
+
+	t = rte_malloc("demu_ber_table", sizeof(*t), RTE_CACHE_LINE_SIZE);
+	if (t == NULL)
+		goto out;
+	t->ber = ber;
+	for (uint32_t len = 0; len < DEMU_BER_MAX_LEN; len++) {
+		double p = -expm1(lp * 8 * len);
+
+		t->prob[len] = p * RANDOM_MAX >= UINT32_MAX ? UINT32_MAX :
+			(uint32_t)(p * RANDOM_MAX);
+	}
+	demu_ber_tables[i] = t;
+out:
+	pthread_mutex_unlock(&demu_ber_lock);
+
+	return t != NULL ? t->prob : NULL;
+}
+
+static inline bool
+demu_ber_event(struct demu_rand *rs, const uint32_t *table, uint32_t len)
+{
+	return demu_rand_get(rs) < table[RTE_MIN(len, DEMU_BER_MAX_LEN - 1U)];
+}
+
+/*
+ * TCP/UDP checksum of the IPv4 datagram ip, which starts at offset
+ * l4_off of m and may span several segments.
+ */
+static uint16_t
+demu_udptcp_cksum_mbuf(const struct rte_mbuf *m, const struct ipv4_hdr *ip,
+		uint32_t l4_off, uint32_t l4_len)
+{
+	uint16_t raw;
+	uint32_t cksum;
+
+	if (rte_raw_cksum_mbuf(m, l4_off, l4_len, &raw) < 0)
+		return 0;
+	cksum = raw + rte_ipv4_phdr_cksum(ip, 0);
+	cksum = ((cksum & 0xffff0000) >> 16) + (cksum & 0xffff);
+	cksum = (~cksum) & 0xffff;
+
+	return cksum == 0 ? 0xffff : cksum;
+}
+
+/*
+ * Recompute the IPv4 header and TCP/UDP checksums of a corrupted packet,
+ * so that it is delivered to the application. Packets whose headers no
+ * longer make sense are left alone. The headers are read from the first
+ * segment, the payload of a jumbo frame may follow in the next ones.
+ */
+static void
+demu_corrupt_fixup(struct rte_mbuf *m)
+{
+	struct ether_hdr *eth = rte_pktmbuf_mtod(m, struct ether_hdr *);
+	struct ipv4_hdr *ip = (struct ipv4_hdr *)(eth + 1);
+	uint32_t len = m->data_len - sizeof(*eth);
+	uint32_t l4_off = sizeof(*eth) + sizeof(*ip);
+	uint16_t total;
+	void *l4;
+
+	if (eth->ether_type != rte_cpu_to_be_16(ETHER_TYPE_IPv4) ||
+			len < sizeof(*ip) || ip->version_ihl != 0x45)
+		return;
+	ip->hdr_checksum = 0;
+	ip->hdr_checksum = rte_ipv4_cksum(ip);
+
+	/* the L4 checksum of a fragment covers the whole datagram */
+	total = rte_be_to_cpu_16(ip->total_length);
+	if (total > m->pkt_len - sizeof(*eth) ||
+			(ip->fragment_offset & rte_cpu_to_be_16(0x3fff)))
+		return;
+	l4 = ip + 1;
+	if (ip->next_proto_id == IPPROTO_TCP && total >= sizeof(*ip) + sizeof(struct tcp_hdr) &&
+			len >= sizeof(*ip) + sizeof(struct tcp_hdr)) {
+		struct tcp_hdr *tcp = l4;
+
+		tcp->cksum = 0;
+		tcp->cksum = demu_udptcp_cksum_mbuf(m, ip, l4_off, total - sizeof(*ip));
+	} else if (ip->next_proto_id == IPPROTO_UDP &&
+			total >= sizeof(*ip) + sizeof(struct udp_hdr) &&
+			len >= sizeof(*ip) + sizeof(struct udp_hdr)) {
+		struct udp_hdr *udp = l4;
+
+		if (udp->dgram_cksum == 0)	/* no checksum */
+			return;
+		udp->dgram_cksum = 0;
+		udp->dgram_cksum = demu_udptcp_cksum_mbuf(m, ip, l4_off, total - sizeof(*ip));
+	}
+}
+
+/*
+ * Flip one random bit past the Ethernet header of each of the n packets,
+ * which at the BERs of interest is what a hit frame gets. The random
+ * numbers are drawn for the whole burst first. The bit is drawn over the
+ * whole frame, which may be a chain of segments.
+ */
+static void
+demu_corrupt_bulk(struct demu_rand *rs, struct rte_mbuf **pkts, const uint16_t *idx,
+		const bool *fixup, unsigned n)
+{
+	uint32_t rnd[PKT_BURST_RX];
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		rnd[i] = demu_rand_get(rs);
+		rte_prefetch0(rte_pktmbuf_mtod(pkts[idx[i]], void *));
+	}
+	for (i = 0; i < n; i++) {
+		struct rte_mbuf *m = pkts[idx[i]], *seg = m;
+		uint32_t bits, bit, off;
+
+		if (m->pkt_len <= sizeof(struct ether_hdr))
+			continue;
+		bits = (m->pkt_len - sizeof(struct ether_hdr)) * 8;
+		bit = ((uint64_t)rnd[i] * bits) >> 32;
+		off = sizeof(struct ether_hdr) + (bit >> 3);
+		while (off >= seg->data_len) {
+			off -= seg->data_len;
+			seg = seg->next;
+		}
+		rte_pktmbuf_mtod(seg, uint8_t *)[off] ^= 1 << (bit & 7);
+		if (fixup[i])
+			demu_corrupt_fixup(m);
+	}
+}
+
+/*
+ * Switch.
+ *
+ * With --switch, the ports of -P form one learning switch instead of
+ * pairs. RX looks the destination MAC up in the forwarding database
+ * (FDB) and floods the packets of unknown or multicast destinations to
+ * every other port. Each (ingress, egress) path has its own pipeline
+ * state and impairments, those of the ingress port unless --path gives
+ * its own.
+ *
+ * The FDB is an open-addressing table of 64-bit entries shared by the RX
+ * lcores without locks: an entry is the MAC in its low 48 bits and the
+ * egress port index above, written with one compare-and-swap. A MAC is
+ * looked for in DEMU_FDB_PROBE entries from its hash. Learnt entries do
+ * not age, and never replace the static entries of --fdb.
+ */
+#define DEMU_FDB_BITS 16
+#define DEMU_FDB_SIZE (1 << DEMU_FDB_BITS)
+#define DEMU_FDB_PROBE 8
+#define DEMU_FDB_MAC_MASK ((1ULL << 48) - 1)
+#define DEMU_FDB_PORT_SHIFT 48
+#define DEMU_FDB_VALID (1ULL << 62)
+#define DEMU_FDB_STATIC (1ULL << 63)
+#define DEMU_FDB_FLOOD UINT8_MAX
+#define DEMU_FDB_CHUNK 32
+#define DEMU_FDB_MAX_STATIC 1024
+
+static bool demu_switch = false;
+static uint64_t demu_fdb[DEMU_FDB_SIZE] __rte_cache_aligned;
+
+static inline uint64_t
+demu_fdb_key(const struct ether_addr *addr)
+{
+	uint64_t key = 0;
+
+	for (int i = 0; i < ETHER_ADDR_LEN; i++)
+		key |= (uint64_t)addr->addr_bytes[i] << (8 * i);
+	return key;
+}
+
+static inline uint32_t
+demu_fdb_hash(uint64_t key)
+{
+	return (key * 0x9e3779b97f4a7c15ULL) >> (64 - DEMU_FDB_BITS);
+}
+
+/* Port index of key, DEMU_FDB_FLOOD if unknown */
+static inline uint8_t
+demu_fdb_lookup(uint64_t key, uint32_t h)
+{
+	for (unsigned j = 0; j < DEMU_FDB_PROBE; j++) {
+		uint64_t e = demu_fdb[(h + j) & (DEMU_FDB_SIZE - 1)];
+
+		if (e == 0)
+			break;
+		if ((e & DEMU_FDB_MAC_MASK) == key)
+			return (uint8_t)(e >> DEMU_FDB_PORT_SHIFT);
+	}
+
+	return DEMU_FDB_FLOOD;
+}
+
+/* Record that key is behind port idx, if there is room */
+static inline void
+demu_fdb_learn(uint64_t key, uint32_t h, uint8_t idx, uint64_t flags)
+{
+	uint64_t entry = key | (uint64_t)idx << DEMU_FDB_PORT_SHIFT | DEMU_FDB_VALID | flags;
+
+	for (unsigned j = 0; j < DEMU_FDB_PROBE; j++) {
+		volatile uint64_t *slot = &demu_fdb[(h + j) & (DEMU_FDB_SIZE - 1)];
+		uint64_t e = *slot;
+
+		/* another lcore may take the slot first, for this MAC or another */
+		if (e == 0 && rte_atomic64_cmpset(slot, 0, entry))
+			return;
+		e = *slot;
+		if ((e & DEMU_FDB_MAC_MASK) != key)
+			continue;
+		if (e != entry && (!(e & DEMU_FDB_STATIC) || flags))
+			rte_atomic64_cmpset(slot, e, entry);
+		return;
+	}
+}
+
+/*
+ * Look the n packets received on port index in up in chunks, to fetch
+ * their headers and then their FDB entries ahead of use, and learn their
+ * sources. Gives the egress port index of each, or DEMU_FDB_FLOOD.
+ */
+static void
+demu_fdb_lookup_bulk(struct rte_mbuf **pkts, unsigned n, uint8_t in, uint8_t *egress)
+{
+	uint64_t dst[DEMU_FDB_CHUNK], src[DEMU_FDB_CHUNK];
+	uint32_t h[DEMU_FDB_CHUNK];
+
+	for (unsigned base = 0; base < n; base += DEMU_FDB_CHUNK) {
+		unsigned len = RTE_MIN(n - base, (unsigned)DEMU_FDB_CHUNK), i;
+
+		for (i = 0; i < len; i++)
+			rte_prefetch0(rte_pktmbuf_mtod(pkts[base + i], void *));
+		for (i = 0; i < len; i++) {
+			struct ether_hdr *eth = rte_pktmbuf_mtod(pkts[base + i], struct ether_hdr *);
+
+			dst[i] = demu_fdb_key(&eth->d_addr);
+			h[i] = demu_fdb_hash(dst[i]);
+			rte_prefetch0(&demu_fdb[h[i]]);
+			/* multicast is always flooded, and a bogus source */
+			if (is_multicast_ether_addr(&eth->d_addr))
+				h[i] = UINT32_MAX;
+			src[i] = is_multicast_ether_addr(&eth->s_addr) ? 0 :
+				demu_fdb_key(&eth->s_addr);
+		}
+		for (i = 0; i < len; i++) {
+			egress[base + i] = h[i] == UINT32_MAX ? DEMU_FDB_FLOOD :
+				demu_fdb_lookup(dst[i], h[i]);
+			if (src[i] != 0)
+				demu_fdb_learn(src[i], demu_fdb_hash(src[i]), in, 0);
+		}
+	}
+}
+
+/*
+ * A copy of m with data of its own, segment by segment, from pool
+ * (DPDK 17.11 has no rte_pktmbuf_copy()). NULL if pool is empty.
+ */
+static struct rte_mbuf *
+demu_pktmbuf_copy(const struct rte_mbuf *m, struct rte_mempool *pool)
+{
+	struct rte_mbuf *c = NULL, *last = NULL;
+
+	for (const struct rte_mbuf *seg = m; seg != NULL; seg = seg->next) {
+		struct rte_mbuf *s = rte_pktmbuf_alloc(pool);
+
+		if (unlikely(s == NULL)) {
+			rte_pktmbuf_free(c);
+			return NULL;
+		}
+		rte_memcpy(rte_pktmbuf_mtod(s, void *), rte_pktmbuf_mtod(seg, void *),
+				seg->data_len);
+		s->data_len = seg->data_len;
+		if (c == NULL) {
+			c = s;
+		} else {
+			last->next = s;
+			c->nb_segs++;
+		}
+		last = s;
+	}
+	c->pkt_len = m->pkt_len;
+	c->port = m->port;
+	c->ol_flags = m->ol_flags;
+	c->packet_type = m->packet_type;
+	c->vlan_tci = m->vlan_tci;
+	c->hash = m->hash;
+
+	return c;
+}
+
+/*
+ * Whether the packets of link, of any class, may be written in place:
+ * by bit errors left in them or by ECN marks.
+ */
+static bool
+demu_link_writes(const struct demu_link *link)
+{
+	const struct demu_link_params *p = demu_link_params_get(link);
+
+	if ((p->ber_table != NULL && p->ber_corrupt) || p->ecn)
+		return true;
+	for (int c = 1; c < DEMU_MAX_CLASSES; c++) {
+		p = link->class_params[c];
+		if (p != NULL && ((p->ber_table != NULL && p->ber_corrupt) || p->ecn))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Forward the n packets of pkts received on port index in to out, giving
+ * the egress port index of each in egress. A packet to flood leaves a
+ * copy to each other port, up to max packets in all; a packet for in
+ * itself is filtered. A packet or copy without room is counted as an
+ * overflow. Returns the number of packets in out.
+ *
+ * The copies are clones from pool, which share the data of the packet,
+ * unless a path of the flood writes into packets: then each copy gets
+ * its own data from copy_pool, so that the errors and marks of a path
+ * do not leave through the others.
+ */
+static unsigned
+demu_switch_forward(struct rte_mbuf **pkts, unsigned n, uint8_t in,
+		struct rte_mbuf **out, uint8_t *egress, unsigned max,
+		struct rte_mempool *pool, struct rte_mempool *copy_pool,
+		struct demu_task_stats *stats)
+{
+	uint8_t dst[PKT_BURST_RX];
+	uint8_t last = in == nb_ports - 1 ? nb_ports - 2 : nb_ports - 1;
+	unsigned nb_out = 0;
+	int deep = -1;			/* whether copies need their own data, once known */
+
+	demu_fdb_lookup_bulk(pkts, n, in, dst);
+	for (unsigned i = 0; i < n; i++) {
+		struct rte_mbuf *m = pkts[i];
+
+		if (dst[i] != DEMU_FDB_FLOOD) {
+			if (unlikely(dst[i] == in)) {
+				rte_pktmbuf_free(m);
+				stats->filtered++;
+				continue;
+			}
+			if (unlikely(nb_out == max)) {
+				rte_pktmbuf_free(m);
+				stats->ring_overflow++;
+				continue;
+			}
+			egress[nb_out] = dst[i];
+			out[nb_out++] = m;
+			continue;
+		}
+
+		if (deep < 0) {
+			deep = demu_link_writes(&demu_links[in]);
+			for (uint8_t e = 0; e < nb_ports; e++)
+				if (demu_links[in].path[e] != NULL &&
+						demu_link_writes(demu_links[in].path[e]))
+					deep = 1;
+		}
+		/* the packet itself goes to the last port, copies to the others */
+		for (uint8_t e = 0; e < last; e++) {
+			struct rte_mbuf *c = NULL;
+
+			if (e == in)
+				continue;
+			if (likely(nb_out < max))
+				c = deep ? demu_pktmbuf_copy(m, copy_pool) : rte_pktmbuf_clone(m, pool);
+			if (unlikely(c == NULL)) {
+				stats->ring_overflow++;
+				continue;
+			}
+			egress[nb_out] = e;
+			out[nb_out++] = c;
+		}
+		if (unlikely(nb_out == max)) {
+			rte_pktmbuf_free(m);
+			stats->ring_overflow++;
+			continue;
+		}
+		egress[nb_out] = last;
+		out[nb_out++] = m;
+	}
+
+	return nb_out;
+}
+
+/*
+ * Hand the n due packets of pipeline q of port index in to the TX queues
+ * of their egress ports, given in m->port by RX. Packets go in runs to
+ * the same port, and stop at the first ring that is full. Returns the
+ * number of packets handed over.
+ */
+static inline unsigned
+demu_switch_release(uint8_t in, uint16_t q, struct rte_mbuf **pkts,
+		uint64_t *deadline, unsigned n)
+{
+	unsigned i = 0;
+
+	while (i < n) {
+		uint16_t e = pkts[i]->port;
+		unsigned len = 1, sent;
+
+		while (i + len < n && pkts[i + len]->port == e)
+			len++;
+		sent = demu_dq_enqueue_burst(ports[e].workers_to_tx[in][q],
+				pkts + i, deadline + i, len);
+		i += sent;
+		if (sent < len)
+			break;
+	}
+
+	return i;
+}
+
+/* Receive a burst on pipeline queue of port, and impair it into the delay line */
+static bool
+demu_rx_poll(struct demu_task *t, unsigned lcore_id, struct demu_scratch *s)
+{
+	struct port_t *port = &ports[t->port_idx];
+	uint16_t queue = t->queue;
+	struct rte_mbuf **pkts_burst = s->rx.pkts_burst, **rx2w_buffer = s->rx.rx2w_buffer;
+	struct rte_mbuf **switched = s->rx.switched, **pkts;
+	uint64_t *rx2w_deadline = s->rx.rx2w_deadline;
+	uint8_t *classes = s->rx.classes;
+	uint8_t *egress = s->rx.egress;
+	uint16_t *corrupt_idx = s->rx.corrupt_idx;
+	bool *corrupt_fixup = s->rx.corrupt_fixup;
+	uint32_t *cap_idx = s->rx.cap_idx;
+	bool cap = t->cap != NULL;
+	unsigned nb_rx, i;
+	unsigned nb_loss;
+	unsigned nb_corrupt;
+	unsigned nb_shaped;
+	unsigned nb_dup;
+	uint32_t numenq;
+	uint64_t now, start;
+	struct demu_rand *rs = &demu_rand_state[lcore_id];
+	const struct demu_link_params *p, *cp;
+	struct demu_link *link = port->link, *path;
+	struct demu_link_rxq *st;
+	struct demu_task_stats *stats = t->stats;
+	uint8_t in = t->port_idx;
+
+	nb_rx = rte_eth_rx_burst((uint8_t) port->portid, queue,
+			pkts_burst, PKT_BURST_RX);
+
+	if (likely(nb_rx == 0))
+		return false;
+
+	stats->rx += nb_rx;
+	pkts = pkts_burst;
+	if (demu_switch) {
+		nb_rx = demu_switch_forward(pkts_burst, nb_rx, in, switched, egress,
+				PKT_BURST_RX, port->small_pool, demu_pktmbuf_pool[port->socket], stats);
+		pkts = switched;
+		if (unlikely(nb_rx == 0))
+			return true;
+	}
+
+	p = demu_link_params_get(link);
+	nb_loss = 0;
+	nb_shaped = 0;
+	nb_corrupt = 0;
+	nb_dup = 0;
+	now = rte_rdtsc();
+	if (demu_acl_ctx != NULL)
+		demu_classify(pkts, nb_rx, classes);
+	/*
+	 * loss (2), bit errors (1), duplication (1), reordering (2) and
+	 * jitter (2) per packet at most
+	 */
+	demu_rand_reserve(rs, RTE_MIN(nb_rx * 8, (unsigned)DEMU_RAND_BUF_SIZE));
+	for (i = 0; i < nb_rx; i++) {
+		struct rte_mbuf *clone;
+		uint8_t cls = 0;
+		bool corrupt = false;
+
+		/* a class takes precedence over the path */
+		path = demu_switch ? link->path[egress[i]] : link;
+		if (demu_acl_ctx != NULL && link->class_params[classes[i]] != NULL)
+			cls = classes[i];
+		if (cls)
+			cp = link->class_params[cls];
+		else
+			cp = path == link ? p : demu_link_params_get(path);
+		st = cls ? &link->rxq[queue][cls] : &path->rxq[queue][0];
+
+		if (loss_event(rs, cp, st)) {
+			if (unlikely(cap))
+				demu_cap_tap(s, pkts[i], demu_cap_meta(now, DEMU_CAP_LOSS, false));
+			rte_pktmbuf_free(pkts[i]);
+			nb_loss++;
+			continue;
+		}
+
+		if (unlikely(cp->ber_table != NULL) &&
+				demu_ber_event(rs, cp->ber_table, pkts[i]->pkt_len)) {
+			if (!cp->ber_corrupt) {
+				if (unlikely(cap))
+					demu_cap_tap(s, pkts[i], demu_cap_meta(now, DEMU_CAP_LOSS, false));
+				rte_pktmbuf_free(pkts[i]);
+				nb_loss++;
+				continue;
+			}
+			corrupt = true;
+		}
+
+		/* the rate of a class queues packets before the delay */
+		start = now;
+		if (cls && cp->limit_speed) {
+			start = demu_class_shape(&link->class_vt[cls], cp->limit_speed,
+					pkts[i]->pkt_len, now);
+			if (start == 0) {
+				if (unlikely(cap))
+					demu_cap_tap(s, pkts[i], demu_cap_meta(now, DEMU_CAP_SHAPING, false));
+				rte_pktmbuf_free(pkts[i]);
+				nb_loss++;
+				nb_shaped++;
+				continue;
+			}
+		}
+
+		rx2w_buffer[i - nb_loss + nb_dup] = demu_pktmbuf_shrink(pkts[i], port->small_pool);
+		/* the worker hands the packet to the TX queue of its egress port */
+		if (demu_switch)
+			rx2w_buffer[i - nb_loss + nb_dup]->port = egress[i];
+		rte_prefetch0(rte_pktmbuf_mtod(rx2w_buffer[i - nb_loss + nb_dup], void *));
+		rx2w_deadline[i - nb_loss + nb_dup] = demu_deadline(rs, cp, st, start);
+		/* the bit is flipped once the burst is stored, past the drops */
+		if (unlikely(corrupt)) {
+			corrupt_idx[nb_corrupt] = i - nb_loss + nb_dup;
+			corrupt_fixup[nb_corrupt++] = cp->ber_csum;
+		}
+		if (unlikely(cap))
+			cap_idx[i - nb_loss + nb_dup] = demu_cap_tap(s, rx2w_buffer[i - nb_loss + nb_dup],
+					demu_cap_meta(now, corrupt ? DEMU_CAP_CORRUPT : DEMU_CAP_PASS, false));
+
+		/*
+		 * A duplicate takes a slot of rx2w_buffer, and so must leave
+		 * one to each packet left in the burst: a full burst, or
+		 * one that flooding filled, is not duplicated past it.
+		 */
+		if (dup_event(rs, cp->dup_rate) && nb_rx - nb_loss + nb_dup < PKT_BURST_RX) {
+			clone = rte_pktmbuf_clone(rx2w_buffer[i - nb_loss + nb_dup], port->small_pool);
+			if (clone == NULL) {
+				RTE_LOG(ERR, DEMU, "cannot clone a packet\n");
+				continue;
+			}
+			/*
+			 * A duplicate gets its own delay. It shares the data
+			 * of the packet, bits flipped later included: the
+			 * errors hit the frame before it is duplicated.
+			 */
+			nb_dup++;
+			rx2w_buffer[i - nb_loss + nb_dup] = clone;
+			rx2w_deadline[i - nb_loss + nb_dup] = demu_deadline(rs, cp, st, start);
+			if (unlikely(cap))
+				cap_idx[i - nb_loss + nb_dup] = demu_cap_tap(s, clone,
+						demu_cap_meta(now, DEMU_CAP_DUP, false));
+		}
+
+	}
+
+	stats->loss += nb_loss - nb_shaped;
+	stats->shaping_dropped += nb_shaped;
+	stats->dup += nb_dup;
+
+	/* a duplicate of a corrupted packet shares its data, and its errors */
+	if (unlikely(nb_corrupt)) {
+		demu_corrupt_bulk(rs, rx2w_buffer, corrupt_idx, corrupt_fixup, nb_corrupt);
+		stats->corrupted += nb_corrupt;
+	}
+
+	numenq = demu_dq_enqueue_burst(port->rx_to_workers[queue],
+				rx2w_buffer, rx2w_deadline, nb_rx - nb_loss + nb_dup);
+
+
+	if (unlikely(numenq < (unsigned)(nb_rx - nb_loss + nb_dup))) {
+		stats->ring_overflow += nb_rx - nb_loss + nb_dup - numenq;
+		if (unlikely(cap))
+			for (i = numenq; i < nb_rx - nb_loss + nb_dup; i++)
+				demu_cap_verdict(s, cap_idx[i], DEMU_CAP_OVERFLOW);
+		pktmbuf_free_bulk(&rx2w_buffer[numenq], nb_rx - nb_loss + nb_dup - numenq);
+	}
+	if (unlikely(cap))
+		demu_cap_flush(t, s);
+
+	return true;
+}
+
+/*
+ * Delay line.
+ *
+ * Each worker keeps the packets it is delaying in a hierarchical timing
+ * wheel keyed on the TSC deadline of the packet. A tick is 2^tick_shift
+ * TSC cycles (about 1us). Level 0 has one slot per tick, and each upper
+ * level covers the whole span of the level below in one slot, so three
+ * levels of 1024 slots cover about 18 minutes. Deadlines beyond that
+ * wait in an overflow list. Packets are cascaded to a lower level at most
+ * once per level, so insertion and expiry are O(1) per packet regardless
+ * of the number of queued packets.
+ *
+ * Wheel entries live in a preallocated node array (one node per packet
+ * that can be queued), linked by index. A slot is a FIFO list, so packets
+ * with the same deadline tick leave in arrival order.
+ */
+#define DEMU_WHEEL_BITS 10
+#define DEMU_WHEEL_SLOTS (1 << DEMU_WHEEL_BITS)
+#define DEMU_WHEEL_MASK (DEMU_WHEEL_SLOTS - 1)
+#define DEMU_WHEEL_LEVELS 3
+#define DEMU_WHEEL_NIL UINT32_MAX
+
+struct demu_wheel_slot {
+	uint32_t head;
+	uint32_t tail;
+};
+
+struct demu_wheel {
+	uint64_t cur_tick;	/* all slots before this tick are drained */
+	uint32_t tick_shift;
+	uint32_t nb_nodes;
+	uint32_t nb_free;
+	uint32_t free_head;
+	/* node array (struct of arrays) */
+	struct rte_mbuf **node_mbuf;
+	uint64_t *node_deadline;
+	uint32_t *node_next;
+	/* occupancy of level 0 slots, to skip empty ticks quickly */
+	uint64_t bitmap[DEMU_WHEEL_SLOTS / 64];
+	struct demu_wheel_slot slot[DEMU_WHEEL_LEVELS][DEMU_WHEEL_SLOTS];
+	struct demu_wheel_slot overflow;
+} __rte_cache_aligned;
+
+static struct demu_wheel *
+demu_wheel_create(uint32_t nb_nodes, int socket_id)
+{
+	struct demu_wheel *w;
+	uint32_t i;
+	int l;
+
+	w = rte_zmalloc_socket("demu_wheel", sizeof(*w), RTE_CACHE_LINE_SIZE, socket_id);
+	if (w == NULL)
+		return NULL;
+
+	w->node_mbuf = rte_malloc_socket("demu_wheel_mbuf",
+			sizeof(*w->node_mbuf) * nb_nodes, RTE_CACHE_LINE_SIZE, socket_id);
+	w->node_deadline = rte_malloc_socket("demu_wheel_deadline",
+			sizeof(*w->node_deadline) * nb_nodes, RTE_CACHE_LINE_SIZE, socket_id);
+	w->node_next = rte_malloc_socket("demu_wheel_next",
+			sizeof(*w->node_next) * nb_nodes, RTE_CACHE_LINE_SIZE, socket_id);
+	if (w->node_mbuf == NULL || w->node_deadline == NULL || w->node_next == NULL) {
+		rte_free(w->node_mbuf);
+		rte_free(w->node_deadline);
+		rte_free(w->node_next);
+		rte_free(w);
+		return NULL;
+	}
+
+	for (i = 0; i < nb_nodes; i++)
+		w->node_next[i] = i + 1;
+	w->node_next[nb_nodes - 1] = DEMU_WHEEL_NIL;
+	w->free_head = 0;
+	w->nb_nodes = nb_nodes;
+	w->nb_free = nb_nodes;
+
+	for (l = 0; l < DEMU_WHEEL_LEVELS; l++)
+		for (i = 0; i < DEMU_WHEEL_SLOTS; i++)
+			w->slot[l][i].head = w->slot[l][i].tail = DEMU_WHEEL_NIL;
+	w->overflow.head = w->overflow.tail = DEMU_WHEEL_NIL;
+
+	/* A tick is the largest power of two of TSC cycles within 1us. */
+	w->tick_shift = 0;
+	while ((2ULL << w->tick_shift) <= rte_get_tsc_hz() / US_PER_S)
+		w->tick_shift++;
+	w->cur_tick = rte_rdtsc() >> w->tick_shift;
+
+	return w;
+}
+
+static inline void
+demu_wheel_link(struct demu_wheel *w, struct demu_wheel_slot *s, uint32_t node)
+{
+	w->node_next[node] = DEMU_WHEEL_NIL;
+	if (s->tail == DEMU_WHEEL_NIL)
+		s->head = node;
+	else
+		w->node_next[s->tail] = node;
+	s->tail = node;
+}
+
+/* Put a node into the slot matching its deadline, relative to cur_tick. */
+static inline void
+demu_wheel_place(struct demu_wheel *w, uint32_t node)
+{
+	uint64_t tick = w->node_deadline[node] >> w->tick_shift;
+	uint64_t diff;
+	uint32_t idx;
+
+	if (tick < w->cur_tick)
+		tick = w->cur_tick;
+
+	/* the highest bit that differs from cur_tick selects the level */
+	diff = tick ^ w->cur_tick;
+	if (diff < (1ULL << DEMU_WHEEL_BITS)) {
+		idx = tick & DEMU_WHEEL_MASK;
+		demu_wheel_link(w, &w->slot[0][idx], node);
+		w->bitmap[idx >> 6] |= 1ULL << (idx & 63);
+	} else if (diff < (1ULL << (DEMU_WHEEL_BITS * 2))) {
+		idx = (tick >> DEMU_WHEEL_BITS) & DEMU_WHEEL_MASK;
+		demu_wheel_link(w, &w->slot[1][idx], node);
+	} else if (diff < (1ULL << (DEMU_WHEEL_BITS * 3))) {
+		idx = (tick >> (DEMU_WHEEL_BITS * 2)) & DEMU_WHEEL_MASK;
+		demu_wheel_link(w, &w->slot[2][idx], node);
+	} else
+		demu_wheel_link(w, &w->overflow, node);
+}
+
+/*
+ * Move the ticks of an empty wheel up to now. A wheel that stood still
+ * (while the ring was the delay line) must catch up before nodes are
+ * placed relative to cur_tick, or they land levels too high.
+ */
+static inline void
+demu_wheel_sync(struct demu_wheel *w, uint64_t now)
+{
+	if (w->nb_free == w->nb_nodes)
+		w->cur_tick = RTE_MAX(w->cur_tick, now >> w->tick_shift);
+}
+
+static inline int
+demu_wheel_insert(struct demu_wheel *w, struct rte_mbuf *m, uint64_t deadline)
+{
+	uint32_t node = w->free_head;
+
+	if (unlikely(node == DEMU_WHEEL_NIL))
+		return -1;
+	w->free_head = w->node_next[node];
+	w->nb_free--;
+
+	w->node_mbuf[node] = m;
+	w->node_deadline[node] = deadline;
+	demu_wheel_place(w, node);
+
+	return 0;
+}
+
+/* Re-place every node of an upper level slot after cur_tick moved into its range. */
+static void
+demu_wheel_cascade_slot(struct demu_wheel *w, struct demu_wheel_slot *s)
+{
+	uint32_t node = s->head;
+	uint32_t next;
+
+	s->head = s->tail = DEMU_WHEEL_NIL;
+	while (node != DEMU_WHEEL_NIL) {
+		next = w->node_next[node];
+		demu_wheel_place(w, node);
+		node = next;
+	}
+}
+
+static void
+demu_wheel_cascade(struct demu_wheel *w)
+{
+	uint64_t t = w->cur_tick;
+
+	if ((t & ((1ULL << (DEMU_WHEEL_BITS * 2)) - 1)) == 0) {
+		if ((t & ((1ULL << (DEMU_WHEEL_BITS * 3)) - 1)) == 0)
+			demu_wheel_cascade_slot(w, &w->overflow);
+		demu_wheel_cascade_slot(w,
+			&w->slot[2][(t >> (DEMU_WHEEL_BITS * 2)) & DEMU_WHEEL_MASK]);
+	}
+	demu_wheel_cascade_slot(w, &w->slot[1][(t >> DEMU_WHEEL_BITS) & DEMU_WHEEL_MASK]);
+}
+
+/* Return the first occupied level 0 slot at or after idx, or DEMU_WHEEL_SLOTS. */
+static inline uint32_t
+demu_wheel_next_slot(const struct demu_wheel *w, uint32_t idx)
+{
+	uint32_t word = idx >> 6;
+	uint64_t bits = w->bitmap[word] & (~0ULL << (idx & 63));
+
+	for (;;) {
+		if (bits)
+			return (word << 6) + __builtin_ctzll(bits);
+		if (++word == DEMU_WHEEL_SLOTS / 64)
+			return DEMU_WHEEL_SLOTS;
+		bits = w->bitmap[word];
+	}
+}
+
+/*
+ * Earliest a packet of w can be due: the start of its first occupied level
+ * 0 slot, or of the next level 0 span if there is none. UINT64_MAX if w is
+ * empty.
+ */
+static inline uint64_t
+demu_wheel_next_deadline(const struct demu_wheel *w)
+{
+	uint32_t idx;
+
+	if (w->nb_free == w->nb_nodes)
+		return UINT64_MAX;
+	idx = demu_wheel_next_slot(w, w->cur_tick & DEMU_WHEEL_MASK);
+	if (idx == DEMU_WHEEL_SLOTS)
+		return ((w->cur_tick | DEMU_WHEEL_MASK) + 1) << w->tick_shift;
+	return ((w->cur_tick & ~(uint64_t)DEMU_WHEEL_MASK) | idx) << w->tick_shift;
+}
+
+/*
+ * Move packets of a level 0 slot whose deadline has passed to out[].
+ * If all is set, every packet of the slot is due. Returns the number of
+ * packets added to out[], which holds at most max more entries.
+ */
+static inline unsigned
+demu_wheel_drain_slot(struct demu_wheel *w, uint32_t idx, uint64_t now, bool all,
+		struct rte_mbuf **out, uint64_t *out_deadline, unsigned max)
+{
+	struct demu_wheel_slot *s = &w->slot[0][idx];
+	uint32_t node = s->head;
+	uint32_t prev = DEMU_WHEEL_NIL;
+	uint32_t next;
+	unsigned n = 0;
+
+	while (node != DEMU_WHEEL_NIL && n < max) {
+		next = w->node_next[node];
+		if (all || w->node_deadline[node] <= now) {
+			out_deadline[n] = w->node_deadline[node];
+			out[n++] = w->node_mbuf[node];
+			if (prev == DEMU_WHEEL_NIL)
+				s->head = next;
+			else
+				w->node_next[prev] = next;
+			if (s->tail == node)
+				s->tail = prev;
+			w->node_next[node] = w->free_head;
+			w->free_head = node;
+			w->nb_free++;
+		} else
+			prev = node;
+		node = next;
+	}
+
+	if (s->head == DEMU_WHEEL_NIL)
+		w->bitmap[idx >> 6] &= ~(1ULL << (idx & 63));
+
+	return n;
+}
+
+/*
+ * Advance the wheel up to now and collect up to max due packets in out[].
+ * Empty ticks are skipped through the level 0 bitmap, so an idle wheel
+ * catches up in a few steps per 1024 ticks.
+ */
+static unsigned
+demu_wheel_expire(struct demu_wheel *w, uint64_t now, struct rte_mbuf **out,
+		uint64_t *out_deadline, unsigned max)
+{
+	uint64_t target = now >> w->tick_shift;
+	uint64_t t;
+	uint32_t idx;
+	unsigned n = 0;
+
+	if (w->nb_free == w->nb_nodes) {
+		demu_wheel_sync(w, now);
+		return 0;
+	}
+
+	while (w->cur_tick < target) {
+		idx = demu_wheel_next_slot(w, w->cur_tick & DEMU_WHEEL_MASK);
+		if (idx == DEMU_WHEEL_SLOTS) {
+			t = (w->cur_tick | DEMU_WHEEL_MASK) + 1;
+			if (t > target) {
+				w->cur_tick = target;
+				break;
+			}
+		} else {
+			t = (w->cur_tick & ~(uint64_t)DEMU_WHEEL_MASK) | idx;
+			if (t >= target) {
+				w->cur_tick = target;
+				break;
+			}
+			w->cur_tick = t;
+			n += demu_wheel_drain_slot(w, idx, now, true, out + n,
+					out_deadline + n, max - n);
+			if (n == max)
+				return n;
+			t++;
+		}
+		w->cur_tick = t;
+		if ((t & DEMU_WHEEL_MASK) == 0)
+			demu_wheel_cascade(w);
+	}
+
+	n += demu_wheel_drain_slot(w, w->cur_tick & DEMU_WHEEL_MASK, now, false,
+			out + n, out_deadline + n, max - n);
+
+	return n;
+}
+
+/*
+ * Slotted delivery, as on links that schedule transmissions, like the
+ * TTIs of LTE or the aggregates of Wi-Fi. A slot starts every slot_time,
+ * late by up to slot_jitter, and releases the packets due by its start
+ * together, up to slot_pkts packets and slot_bytes bytes. The packets
+ * that do not fit are carried over, in order, and go first in the next
+ * slot.
+ */
+struct demu_slot {
+	uint64_t grid;			/* start of the slot without jitter */
+	uint64_t start;			/* start of the slot */
+	uint32_t pkts_left;
+	uint32_t bytes_left;
+	uint32_t nb_released;
+	bool open;
+	unsigned nb_carry;
+	struct rte_mbuf *carry[PKT_BURST_WORKER];
+	uint64_t carry_deadline[PKT_BURST_WORKER];
+};
+
+static unsigned
+demu_slot_expire(struct demu_slot *s, struct demu_wheel *w, struct demu_rand *rs,
+		const struct demu_link_params *p, uint64_t now,
+		struct rte_mbuf **out, uint64_t *out_deadline)
+{
+	unsigned n, i, max, nc, left;
+
+	if (!s->open) {
+		if (now < s->start)
+			return 0;
+		/* after an idle period, start from the current slot */
+		if (now - s->grid >= 2 * p->slot_time) {
+			s->grid = now - (now - s->grid) % p->slot_time;
+			s->start = s->grid;
+		}
+		s->pkts_left = p->slot_pkts ? p->slot_pkts : UINT32_MAX;
+		s->bytes_left = p->slot_bytes ? p->slot_bytes : UINT32_MAX;
+		s->nb_released = 0;
+		s->open = true;
+	}
+
+	max = RTE_MIN((uint32_t)PKT_BURST_WORKER, s->pkts_left);
+	/* the packets carried over from the last slot go first */
+	nc = RTE_MIN(s->nb_carry, max);
+	rte_memcpy(out, s->carry, nc * sizeof(*out));
+	rte_memcpy(out_deadline, s->carry_deadline, nc * sizeof(*out_deadline));
+	n = nc;
+	if (nc == s->nb_carry && n < max)
+		n += demu_wheel_expire(w, s->start, out + n, out_deadline + n, max - n);
+	for (i = 0; i < n; i++) {
+		/* a packet larger than the whole slot still goes alone */
+		if (out[i]->pkt_len > s->bytes_left && s->nb_released + i > 0)
+			break;
+		s->bytes_left -= RTE_MIN(out[i]->pkt_len, s->bytes_left);
+	}
+	/* carry what did not fit, ahead of what was not taken from the carry */
+	left = n - i;
+	memmove(s->carry + left, s->carry + nc, (s->nb_carry - nc) * sizeof(*s->carry));
+	memmove(s->carry_deadline + left, s->carry_deadline + nc,
+			(s->nb_carry - nc) * sizeof(*s->carry_deadline));
+	rte_memcpy(s->carry, out + i, left * sizeof(*out));
+	rte_memcpy(s->carry_deadline, out_deadline + i, left * sizeof(*out_deadline));
+	s->nb_carry = left + s->nb_carry - nc;
+	s->pkts_left -= i;
+	s->nb_released += i;
+
+	if (i < max || s->pkts_left == 0) {
+		s->open = false;
+		s->grid += p->slot_time;
+		s->start = RTE_MAX(s->start, s->grid + (p->slot_jitter ?
+				((uint64_t)demu_rand_get(rs) * p->slot_jitter) >> 32 : 0));
+	}
+
+	return i;
+}
+
+/* Release what a slot carried over, once the slots are turned off */
+static unsigned
+demu_slot_flush(struct demu_slot *s, struct rte_mbuf **out, uint64_t *out_deadline)
+{
+	unsigned n = s->nb_carry;
+
+	rte_memcpy(out, s->carry, n * sizeof(*out));
+	rte_memcpy(out_deadline, s->carry_deadline, n * sizeof(*out_deadline));
+	s->nb_carry = 0;
+	s->open = false;
+
+	return n;
+}
+
+/* State a worker keeps between polls */
+struct demu_worker {
+	struct rte_mbuf *release_buffer[PKT_BURST_WORKER];
+	uint64_t release_deadline[PKT_BURST_WORKER];
+	unsigned release_head;
+	unsigned release_tail;
+	bool held;			/* release_buffer is counted as held */
+	struct demu_slot slot;
+};
+
+/*
+ * Move what RX delayed on pipeline queue of port into the delay line,
+ * and release the due packets to TX. Busy while there are packets to
+ * move or release; *until is lowered to the next deadline otherwise.
+ */
+static bool
+demu_worker_poll(struct demu_task *t, unsigned lcore_id, struct demu_scratch *s,
+		uint64_t *until)
+{
+	struct port_t *port = &ports[t->port_idx];
+	uint16_t queue = t->queue;
+	struct demu_worker *w = t->worker;
+	struct demu_wheel *wheel = port->wheel[queue];
+	struct demu_dq *rxq = port->rx_to_workers[queue];
+	struct rte_mbuf **burst_buffer = s->worker.burst_buffer;
+	uint64_t *burst_deadline = s->worker.burst_deadline;
+	const struct demu_link_params *p;
+	unsigned burst_size, i, released;
+	bool in_order;
+	uint64_t now, next;
+	struct demu_rand *rs = &demu_rand_state[lcore_id];
+	struct demu_task_stats *stats = t->stats;
+
+	/*
+	 * Without jitter (or with fifo jitter), reordering, slots,
+	 * classes and switch paths the deadlines leave RX in order, and
+	 * the ring itself is the delay line: the due packets are at its
+	 * head. Otherwise the packets are sorted by the timing wheel,
+	 * which is emptied before going back to the ring.
+	 */
+	p = demu_link_params_get(port->link);
+	in_order = (p->jitter_time == 0 || p->jitter_fifo) && p->reorder_rate == 0 &&
+		p->slot_time == 0 && demu_acl_ctx == NULL && !demu_switch &&
+		wheel->nb_free == wheel->nb_nodes && w->slot.nb_carry == 0;
+
+	burst_size = 0;
+	if (!in_order) {
+		/* never take more packets than the delay line can hold */
+		burst_size = demu_dq_dequeue_burst(rxq, burst_buffer, burst_deadline,
+				RTE_MIN((unsigned)PKT_BURST_WORKER, wheel->nb_free));
+		if (burst_size)
+			demu_wheel_sync(wheel, rte_rdtsc());
+		for (i = 0; i < burst_size; i++)
+			demu_wheel_insert(wheel, burst_buffer[i], burst_deadline[i]);
+	}
+
+	/*
+	 * Release every due packet in one bulk enqueue. Packets the TX
+	 * ring could not take stay in the release buffer and go first next
+	 * time, and the packets behind them wait in the delay line:
+	 * this is how TX pushes back when its bottleneck queue is full.
+	 */
+	if (w->release_head == w->release_tail) {
+		now = rte_rdtsc();
+		w->release_head = 0;
+		w->held = false;
+		if (in_order)
+			w->release_tail = demu_dq_dequeue_due(rxq, now, w->release_buffer,
+					w->release_deadline, PKT_BURST_WORKER);
+		else if (p->slot_time)
+			w->release_tail = demu_slot_expire(&w->slot, wheel, rs, p, now,
+					w->release_buffer, w->release_deadline);
+		else if (unlikely(w->slot.nb_carry))
+			w->release_tail = demu_slot_flush(&w->slot, w->release_buffer,
+					w->release_deadline);
+		else
+			w->release_tail = demu_wheel_expire(wheel, now, w->release_buffer,
+					w->release_deadline, PKT_BURST_WORKER);
+		if (w->release_tail == 0) {
+			/*
+			 * Idle until the next deadline. A packet received
+			 * meanwhile with a shorter delay than --idle-sleep
+			 * can be late by up to it.
+			 */
+			if (in_order)
+				next = demu_dq_next_deadline(rxq);
+			else if (p->slot_time && w->slot.open)
+				next = now;
+			else if (p->slot_time && w->slot.nb_carry)
+				next = w->slot.start;
+			else if (p->slot_time)
+				/* the packets due wait for the start of the next slot */
+				next = RTE_MAX(w->slot.start, demu_wheel_next_deadline(wheel));
+			else
+				next = demu_wheel_next_deadline(wheel);
+			*until = RTE_MIN(*until, next);
+			if (port->release_next[queue].tsc != next)
+				__atomic_store_n(&port->release_next[queue].tsc, next,
+						__ATOMIC_RELAXED);
+			return burst_size != 0;
+		}
+	}
+	if (demu_switch)
+		released = demu_switch_release(t->port_idx, queue,
+				w->release_buffer + w->release_head,
+				w->release_deadline + w->release_head,
+				w->release_tail - w->release_head);
+	else
+		released = demu_dq_enqueue_burst(port->workers_to_tx_other[queue],
+				w->release_buffer + w->release_head,
+				w->release_deadline + w->release_head,
+				w->release_tail - w->release_head);
+	w->release_head += released;
+	if (unlikely(w->release_head < w->release_tail) && !w->held) {
+		stats->held += w->release_tail - w->release_head;
+		w->held = true;
+	}
+
+	return true;
+}
+
+/*
+ * Traffic generator.
+ *
+ * With --gen, DEMU needs no NIC: each port of -P is a ring port, and a
+ * generator task stands for the hosts on both sides. It feeds RX queue q
+ * of every port with UDP packets of the flows of that queue, as RSS
+ * would, and drains TX queue q of every port, recording how long each
+ * packet took through DEMU from the TSC stored in its payload.
+ */
+#define DEMU_GEN_MAX_SIZES 16
+#define DEMU_GEN_MIN_SIZE 64		/* frame sizes include the FCS */
+#define DEMU_GEN_MAX_SIZE ETHER_MAX_JUMBO_FRAME_LEN	/* and at most that of --mtu */
+#define DEMU_GEN_RING_SIZE 4096
+#define DEMU_GEN_BURST 32
+#define DEMU_GEN_DRAIN_MS 1000		/* quit once nothing came back for this long */
+#define DEMU_GEN_UDP_PORT 1024
+
+struct demu_gen_conf {
+	uint64_t rate;			/* packets per second and port, 0 is as fast as DEMU takes them */
+	uint16_t sizes[DEMU_GEN_MAX_SIZES];	/* frame sizes, in turn */
+	unsigned nb_sizes;
+	uint32_t flows;			/* UDP flows per port */
+	uint64_t time;			/* seconds to send for, 0 is until stopped */
+};
+
+struct demu_gen_payload {
+	uint64_t tsc;			/* when the packet was generated */
+	uint8_t port_idx;		/* port it was sent to */
+} __attribute__((__packed__));
+
+/* The packets generated on a port, and what came out of DEMU of them */
+struct demu_gen_port {
+	struct rte_ring *rx[DEMU_MAX_QUEUES];	/* to the RX queues of the port */
+	struct rte_ring *tx[DEMU_MAX_QUEUES];	/* from the TX queues of the port */
+	uint64_t sent;
+	uint64_t missed;		/* the RX ring of the port was full */
+	uint64_t received;
+	uint32_t flow;			/* next flow */
+	unsigned size;			/* index of the next size */
+	struct demu_hist latency;
+};
+
+static bool demu_gen = false;
+static struct demu_gen_conf demu_gen_conf = {
+	.sizes = {DEMU_GEN_MIN_SIZE},
+	.nb_sizes = 1,
+	.flows = 1,
+};
+static struct demu_gen_port *demu_gen_ports;
+static uint64_t demu_gen_start, demu_gen_stop, demu_gen_last_tx;
+static uint64_t demu_gen_first_rx, demu_gen_last_rx;
+
+/*
+ * Make each port of -P a ring port. They are created in the order of
+ * their ids, so they get the ids of -P when no other port exists (with
+ * --no-pci, for instance).
+ */
+static int
+demu_gen_ports_create(void)
+{
+	char name[RTE_RING_NAMESIZE];
+	int portid;
+
+	demu_gen_ports = rte_zmalloc("demu_gen_ports", sizeof(*demu_gen_ports) * nb_ports,
+			RTE_CACHE_LINE_SIZE);
+	if (demu_gen_ports == NULL)
+		return -1;
+
+	for (unsigned id = 0; id < RTE_MAX_ETHPORTS; id++) {
+		for (int i = 0; i < nb_ports; i++) {
+			struct demu_gen_port *g = &demu_gen_ports[i];
+
+			if (ports[i].portid != id)
+				continue;
+			for (uint16_t q = 0; q < nb_queues; q++) {
+				snprintf(name, sizeof(name), "demu_gen_rx_%u_%u", id, q);
+				g->rx[q] = rte_ring_create(name, DEMU_GEN_RING_SIZE, rte_socket_id(),
+						RING_F_SP_ENQ | RING_F_SC_DEQ);
+				snprintf(name, sizeof(name), "demu_gen_tx_%u_%u", id, q);
+				g->tx[q] = rte_ring_create(name, DEMU_GEN_RING_SIZE, rte_socket_id(),
+						RING_F_SP_ENQ | RING_F_SC_DEQ);
+				if (g->rx[q] == NULL || g->tx[q] == NULL)
+					return -1;
+			}
+			snprintf(name, sizeof(name), "demu_gen%u", id);
+			portid = rte_eth_from_rings(name, g->rx, nb_queues, g->tx, nb_queues,
+					rte_socket_id());
+			if (portid != (int)id) {
+				RTE_LOG(ERR, DEMU, "Ring port %s got id %d instead of %u\n",
+						name, portid, id);
+				return -1;
+			}
+			g->latency.portid = id;
+			g->latency.used = true;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Write a UDP packet of flow, from port index i, at m. A frame larger
+ * than an mbuf is chained over further mbufs of its pool, as RX scatter
+ * receives it. Returns -1 if the pool ran out of them.
+ */
+static int
+demu_gen_fill(struct rte_mbuf *m, uint8_t i, uint32_t flow, uint16_t size, uint64_t now)
+{
+	static const struct ether_addr mac = {{0x02, 0, 0, 0, 0, 0}};
+	struct ether_hdr *eth = rte_pktmbuf_mtod(m, struct ether_hdr *);
+	struct ipv4_hdr *ip = (struct ipv4_hdr *)(eth + 1);
+	struct udp_hdr *udp = (struct udp_hdr *)(ip + 1);
+	struct demu_gen_payload *payload = (struct demu_gen_payload *)(udp + 1);
+	uint16_t len = size - ETHER_CRC_LEN;
+	uint16_t room = rte_pktmbuf_data_room_size(m->pool) - RTE_PKTMBUF_HEADROOM;
+	struct rte_mbuf *last = m;
+	uint16_t left;
+	/* the flows of a switch port go to each other port in turn */
+	uint8_t e = demu_switch ? (i + 1 + flow % (nb_ports - 1)) % nb_ports : i ^ 1;
+
+	ether_addr_copy(&mac, &eth->d_addr);
+	eth->d_addr.addr_bytes[5] = ports[e].portid;
+	ether_addr_copy(&mac, &eth->s_addr);
+	eth->s_addr.addr_bytes[5] = ports[i].portid;
+	eth->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+	ip->version_ihl = 0x45;
+	ip->type_of_service = 0;
+	ip->total_length = rte_cpu_to_be_16(len - sizeof(*eth));
+	ip->packet_id = 0;
+	ip->fragment_offset = 0;
+	ip->time_to_live = 64;
+	ip->next_proto_id = IPPROTO_UDP;
+	ip->src_addr = rte_cpu_to_be_32(IPv4(10, 0, ports[i].portid, 1));
+	ip->dst_addr = rte_cpu_to_be_32(IPv4(10, 0, ports[e].portid, 1));
+	ip->hdr_checksum = 0;
+	ip->hdr_checksum = rte_ipv4_cksum(ip);
+
+	udp->src_port = rte_cpu_to_be_16(DEMU_GEN_UDP_PORT + flow);
+	udp->dst_port = rte_cpu_to_be_16(DEMU_GEN_UDP_PORT);
+	udp->dgram_len = rte_cpu_to_be_16(len - sizeof(*eth) - sizeof(*ip));
+	udp->dgram_cksum = 0;
+
+	payload->tsc = now;
+	payload->port_idx = i;
+
+	m->data_len = RTE_MIN(len, room);
+	m->pkt_len = len;
+	m->port = ports[i].portid;
+	for (left = len - m->data_len; left; left -= last->data_len) {
+		struct rte_mbuf *seg = rte_pktmbuf_alloc(m->pool);
+
+		if (unlikely(seg == NULL))
+			return -1;
+		seg->data_len = RTE_MIN(left, room);
+		last->next = seg;
+		last = seg;
+		m->nb_segs++;
+	}
+
+	return 0;
+}
+
+/* Packets a port should have been sent elapsed cycles after the start */
+static inline uint64_t
+demu_gen_target(uint64_t elapsed)
+{
+	uint64_t hz = rte_get_tsc_hz();
+
+	return elapsed / hz * demu_gen_conf.rate + elapsed % hz * demu_gen_conf.rate / hz;
+}
+
+/* Generate the packets due on each port */
+static void
+demu_gen_send(uint64_t now)
+{
+	struct rte_mbuf *pkts[DEMU_GEN_BURST];
+	struct rte_mbuf *queued[DEMU_MAX_QUEUES][DEMU_GEN_BURST];
+	unsigned nb_queued[DEMU_MAX_QUEUES];
+
+	for (int i = 0; i < nb_ports; i++) {
+		struct demu_gen_port *g = &demu_gen_ports[i];
+		struct rte_mempool *pool = demu_pktmbuf_pool[ports[i].socket];
+		uint64_t n = DEMU_GEN_BURST;
+
+		if (demu_gen_conf.rate)
+			n = RTE_MIN(n, demu_gen_target(now - demu_gen_start) - g->sent - g->missed);
+		else
+			for (uint16_t q = 0; q < nb_queues; q++)
+				n = RTE_MIN(n, (uint64_t)rte_ring_free_count(g->rx[q]));
+		if (n == 0 || rte_pktmbuf_alloc_bulk(pool, pkts, n) != 0)
+			continue;
+
+		memset(nb_queued, 0, sizeof(nb_queued));
+		for (unsigned k = 0; k < n; k++) {
+			uint32_t flow = g->flow;
+			uint16_t q = flow % nb_queues;
+
+			/* the rest is sent when mbufs are back */
+			if (unlikely(demu_gen_fill(pkts[k], i, flow,
+						demu_gen_conf.sizes[g->size], now) < 0)) {
+				pktmbuf_free_bulk(pkts + k, n - k);
+				break;
+			}
+			queued[q][nb_queued[q]++] = pkts[k];
+			g->flow = flow + 1 == demu_gen_conf.flows ? 0 : flow + 1;
+			g->size = g->size + 1 == demu_gen_conf.nb_sizes ? 0 : g->size + 1;
+		}
+
+		for (uint16_t q = 0; q < nb_queues; q++) {
+			unsigned sent;
+
+			if (nb_queued[q] == 0)
+				continue;
+			sent = rte_ring_sp_enqueue_burst(g->rx[q], (void **)queued[q],
+					nb_queued[q], NULL);
+			g->sent += sent;
+			g->missed += nb_queued[q] - sent;
+			pktmbuf_free_bulk(queued[q] + sent, nb_queued[q] - sent);
+		}
+	}
+	demu_gen_last_tx = now;
+}
+
+/* Take in the packets DEMU sent out of each port */
+static bool
+demu_gen_receive(uint64_t now)
+{
+	struct rte_mbuf *pkts[DEMU_GEN_BURST];
+	bool busy = false;
+
+	for (int e = 0; e < nb_ports; e++) {
+		for (uint16_t q = 0; q < nb_queues; q++) {
+			unsigned n = rte_ring_sc_dequeue_burst(demu_gen_ports[e].tx[q],
+					(void **)pkts, DEMU_GEN_BURST, NULL);
+
+			for (unsigned k = 0; k < n; k++) {
+				const struct demu_gen_payload *payload = rte_pktmbuf_mtod_offset(pkts[k],
+						const struct demu_gen_payload *, sizeof(struct ether_hdr) +
+						sizeof(struct ipv4_hdr) + sizeof(struct udp_hdr));
+				uint64_t tsc = payload->tsc;
+				struct demu_gen_port *g;
+
+				/* bit errors may have hit the payload */
+				if (unlikely(payload->port_idx >= nb_ports))
+					continue;
+				g = &demu_gen_ports[payload->port_idx];
+				g->received++;
+				demu_hist_record(&g->latency, &tsc, 1, now);
+			}
+			pktmbuf_free_bulk(pkts, n);
+			if (n) {
+				if (demu_gen_first_rx == 0)
+					demu_gen_first_rx = now;
+				demu_gen_last_rx = now;
+				busy = true;
+			}
+		}
+	}
+
+	return busy;
+}
+
+/*
+ * Send until --gen time is over, then quit once DEMU has sent nothing for
+ * DEMU_GEN_DRAIN_MS. The generator has always work.
+ */
+static bool
+demu_gen_poll(void)
+{
+	uint64_t now = rte_rdtsc();
+
+	if (unlikely(demu_gen_start == 0)) {
+		demu_gen_start = now;
+		demu_gen_last_rx = now;
+		if (demu_gen_conf.time)
+			demu_gen_stop = now + demu_gen_conf.time * rte_get_tsc_hz();
+	}
+
+	if (demu_gen_stop == 0 || now < demu_gen_stop)
+		demu_gen_send(now);
+	if (!demu_gen_receive(now) && demu_gen_stop && now >= demu_gen_stop &&
+			now - demu_gen_last_rx > rte_get_tsc_hz() / 1000 * DEMU_GEN_DRAIN_MS) {
+		RTE_LOG(INFO, DEMU, "Generator done\n");
+		force_quit = true;
+	}
+
+	return true;
+}
+
+/* Print the rates and latencies of the packets generated on each port */
+static void
+demu_gen_print(FILE *out)
+{
+	double hz = rte_get_tsc_hz();
+	double in = (demu_gen_last_tx - demu_gen_start) / hz;
+	double out_time = (demu_gen_last_rx - demu_gen_first_rx) / hz;
+
+	for (int i = 0; i < nb_ports; i++) {
+		const struct demu_gen_port *g = &demu_gen_ports[i];
+
+		fprintf(out, "gen port %u: sent %" PRIu64 " missed %" PRIu64 " received %"
+				PRIu64 ", %.3f Mpps in %.3f Mpps out\n", ports[i].portid,
+				g->sent, g->missed, g->received,
+				in > 0 ? g->sent / in / 1e6 : 0,
+				out_time > 0 ? g->received / out_time / 1e6 : 0);
+		fprintf(out, "gen port %u: latency", ports[i].portid);
+		demu_hist_print_pct(out, &g->latency);
+		fprintf(out, " us\n");
+	}
+}
+
+static const char *const demu_task_names[] = {
+	[RX] = "rx",
+	[TX] = "tx",
+	[WORKER] = "worker",
+	[TIMER] = "timer",
+	[GEN] = "gen",
+	[CAPTURE] = "capture",
+};
+
+/*
+ * Poll the tasks of this lcore in turn. The lcore idles only when none
+ * of them has work, until the earliest deadline of its workers.
+ */
+static int
+demu_launch_one_lcore(__attribute__((unused)) void *dummy)
+{
+	unsigned lcore_id = rte_lcore_id();
+	struct demu_task *tasks[DEMU_MAX_TASKS];
+	struct demu_scratch *scratch;
+	struct demu_idle idle;
+	struct demu_task_stats *idle_stats = NULL;
+	unsigned nb_tasks = 0;
+	uint64_t until;
+	bool busy;
+
+	for (unsigned i = 0; i < demu_nb_tasks; i++) {
+		struct demu_task *t = &demu_tasks[i];
+
+		if (t->lcore_id != lcore_id)
+			continue;
+		tasks[nb_tasks++] = t;
+		/* the sleeps of the lcore are counted with its first pipeline */
+		if (idle_stats == NULL)
+			idle_stats = t->stats;
+		if (t->type == TIMER) {
+			RTE_LOG(INFO, DEMU, "Entering timer loop on lcore %u\n", lcore_id);
+			demu_timer_init(lcore_id);
+		} else if (t->type == GEN)
+			RTE_LOG(INFO, DEMU, "Entering generator loop on lcore %u\n", lcore_id);
+		else if (t->type == CAPTURE)
+			RTE_LOG(INFO, DEMU, "Entering capture loop on lcore %u\n", lcore_id);
+		else
+			RTE_LOG(INFO, DEMU, "Entering main %s loop on lcore %u portid %u queue %u\n",
+					demu_task_names[t->type], lcore_id,
+					ports[t->port_idx].portid, t->queue);
+	}
+	if (nb_tasks == 0)
+		return 0;
+
+	scratch = rte_malloc_socket("demu_scratch", sizeof(*scratch), RTE_CACHE_LINE_SIZE,
+			rte_socket_id());
+	if (scratch == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot allocate buffers of lcore %u\n", lcore_id);
+	demu_idle_init(&idle);
+
+	demu_qsbr_online(lcore_id);
+	while (!force_quit) {
+		demu_qsbr_quiescent(lcore_id);
+
+		busy = false;
+		until = UINT64_MAX;
+		for (unsigned i = 0; i < nb_tasks; i++) {
+			struct demu_task *t = tasks[i];
+
+			switch (t->type) {
+			case RX:
+				busy |= demu_rx_poll(t, lcore_id, scratch);
+				break;
+			case WORKER:
+				busy |= demu_worker_poll(t, lcore_id, scratch, &until);
+				break;
+			case TX:
+				busy |= demu_tx_poll(t, lcore_id, scratch, &until);
+				break;
+			case TIMER:
+				busy |= demu_timer_poll();
+				break;
+			case GEN:
+				busy |= demu_gen_poll();
+				break;
+			case CAPTURE:
+				busy |= demu_cap_poll();
+				break;
+			}
+		}
+		if (busy)
+			demu_idle_busy(&idle);
+		else
+			demu_idle_poll(&idle, lcore_id, until, idle_stats);
+	}
+	demu_qsbr_offline(lcore_id);
+	rte_free(scratch);
+
+	return 0;
+}
+
+/* display usage */
+static void
+demu_usage(const char *prgname)
 {
 	printf("%s [EAL options] -- "
-		" -P (portid,portid,delayed_us)[,(portid,portid,delayed_us)]: link to add effect.\n"
-		"                                       required argument.\n"
+		" -P (portid,portid,delayed_us[,delayed_us])[,(portid,portid,delayed_us)]: link to add effect.\n"
+		"                                       required argument. The optional second\n"
+		"                                       delay is for the reverse direction.\n"
 		" -p PORTMASK: HEXADECIMAL bitmask of ports to configure\n"
+		" -q NQUEUES: number of RSS queues (and pipelines) per port (default is 1)\n"
 		" -r random packet loss %% (default is 0%%)\n"
 		" -g XXX\n"
 		" -s bandwidth limitation [bps]\n"
-		" -D duplicate packet rate\n",
+		" -D duplicate packet rate\n"
+		" -j delay jitter [us] (default is 0)\n"
+		" --jitter-dist DIST: jitter distribution, uniform (default), normal,\n"
+		"                     pareto, paretonormal or a netem table file\n"
+		" --jitter-corr CORR: correlation of successive jitters [%%]\n"
+		" --jitter-fifo: do not reorder packets because of jitter\n"
+		" --seed SEED: seed of the random number generators, to replay\n"
+		"              the loss, duplication and jitter pattern of a run\n"
+		" --link PORTID:KEY=VAL[,KEY=VAL...]: impairments of the packets received\n"
+		"              on PORTID, overriding the options above. KEY is delay,\n"
+		"              jitter, jitter-corr, fifo, loss, ge (R:G), dup, rate,\n"
+		"              ber, ber-mode, ber-csum, slot, slot-jitter, slot-pkts,\n"
+		"              slot-bytes, reorder, reorder-corr, reorder-gap, or\n"
+		"              aqm, ecn, limit, limit-bytes, target, interval, red-min,\n"
+		"              red-max and red-prob for the queue in front of the rate\n"
+		" --ctrl PATH: change the --link parameters at runtime through\n"
+		"              commands on the Unix socket PATH\n"
+		" --profile PORTID:FILE: replay the time-varying impairments of FILE\n"
+		"              on the packets received on PORTID\n"
+		" --trace PORTID:FILE: send the packets received on PORTID at the\n"
+		"              delivery opportunities of a Mahimahi trace FILE\n"
+		" --class CLASS:KEY=VAL[,KEY=VAL...]: impairments of the packets of\n"
+		"              CLASS (1 to 7), with the keys of --link\n"
+		" --rules FILE: classify IPv4 packets by proto, src, dst, sport,\n"
+		"              dport and dscp with the rules of FILE\n"
+		" --switch: switch the packets between all the ports of -P by\n"
+		"              destination MAC, learning the sources\n"
+		" --path IN:OUT:KEY=VAL[,KEY=VAL...]: impairments of the packets\n"
+		"              switched from port IN to port OUT, with the keys of --link\n"
+		" --fdb PORTID:MAC: send the packets to MAC out of PORTID\n"
+		" --idle-sleep US: let the RX, worker and TX lcores sleep up to US\n"
+		"              when they have no work (default is 0, always poll)\n"
+		" --lcore-map LCORE=ROLE[+ROLE][,...]: place the tasks on the lcores,\n"
+		"              ROLE is timer, gen or rx|worker|tx|rtc:PORTID[.QUEUE]\n"
+		" --gen KEY=VAL[,KEY=VAL...]: emulate ring ports fed by a generator,\n"
+		"              keys are rate (pps per port), size (bytes[:bytes...]),\n"
+		"              flows and time (s)\n"
+		" --capture FILE[,snaplen=N][,sample=N]: write the packets received\n"
+		"              with their verdicts, and sent, to the pcapng FILE,\n"
+		"              N bytes of each, of 1 flow in N\n"
+		" --mtu MTU: receive and send frames of up to MTU bytes of IP\n"
+		"              packet (default is 1500), jumbo frames above it\n",
 		prgname);
 }
 
 static int
-demu_parse_portmask(const char *portmask)
+demu_parse_portmask(const char *portmask)
+{
+	char *end = NULL;
+	unsigned long pm;
+
+	/* parse hexadecimal string */
+	pm = strtoul(portmask, &end, 16);
+	if ((portmask[0] == '\0') || (end == NULL) || (*end != '\0'))
+		return -1;
+
+	return pm;
+}
+
+static uint64_t
+demu_us_to_tsc(uint64_t us)
+{
+	return ((rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S) * us;
+}
+
+static int
+demu_parse_port_pairs(const char *q_arg)
+{
+	char s[256];
+	const char *p, *p0 = q_arg;
+	char *end;
+	enum fieldnames {
+		FLD_PORT = 0,
+		FLD_PORT_OTHER,
+		FLD_DELAYED_TIME,
+		FLD_DELAYED_TIME_OTHER,	/* optional, delay of the reverse direction */
+		_NUM_FLD
+	};
+	unsigned long int_fld[_NUM_FLD];
+	char *str_fld[_NUM_FLD];
+	int i, nb_fld;
+	unsigned size;
+
+	nb_ports = 0;
+
+	while ((p = strchr(p0,'(')) != NULL) {
+		++p;
+		if((p0 = strchr(p,')')) == NULL)
+			return -1;
+
+		size = p0 - p;
+		if(size >= sizeof(s))
+			return -1;
+
+		snprintf(s, sizeof(s), "%.*s", size, p);
+		nb_fld = rte_strsplit(s, sizeof(s), str_fld, _NUM_FLD, ',');
+		if (nb_fld < FLD_DELAYED_TIME_OTHER)
+			return -1;
+
+		for (i = 0; i < nb_fld; i++){
+			errno = 0;
+			int_fld[i] = strtoul(str_fld[i], &end, 0);
+			if (end == str_fld[i])
+				return -1;
+		}
+		if (nb_fld == FLD_DELAYED_TIME_OTHER)
+			int_fld[FLD_DELAYED_TIME_OTHER] = int_fld[FLD_DELAYED_TIME];
+
+		if (nb_ports + 2 > RTE_MAX_ETHPORTS) {
+			printf("exceeded max number of ports: %hu\n",
+				nb_ports);
+			return -1;
+		}
+
+		ports[nb_ports].portid = (uint8_t)int_fld[FLD_PORT];
+		demu_port_delay[nb_ports] = demu_us_to_tsc(int_fld[FLD_DELAYED_TIME]);
+		++nb_ports;
+
+		ports[nb_ports].portid = (uint8_t)int_fld[FLD_PORT_OTHER];
+		demu_port_delay[nb_ports] = demu_us_to_tsc(int_fld[FLD_DELAYED_TIME_OTHER]);
+		++nb_ports;
+	}
+
+	return 0;
+}
+
+static int64_t
+demu_parse_speed(const char *arg)
+{
+	int64_t speed, base;
+	char *end = NULL;
+
+	speed = strtoul(arg, &end, 10);
+	if (end != NULL) {
+		char unit = *end;
+
+		switch (unit) {
+			case 'k':
+			case 'K':
+				base = 1000;
+				break;
+			case 'm':
+			case 'M':
+				base = 1000 * 1000;
+				break;
+			case 'g':
+			case 'G':
+				if (speed > 10) return -1;
+				base = 1000 * 1000 * 1000;
+				break;
+			default:
+				return -1;
+		}
+		end++;
+	}
+
+	if (arg[0] == '\0' || end == NULL || *end != '\0') {
+		return -1;
+	}
+
+	speed = speed * base;
+	if (speed < 1000 && 10000000000 < speed)
+		return -1;
+
+	return speed;
+}
+
+/*
+ * Give every direction the global parameters (keeping the delay given by
+ * -P), and wire each port to the contexts of its two directions. The
+ * packets received on a port take its parameters to its peer, or to
+ * every other port of a switch.
+ */
+static int
+demu_links_init(void)
+{
+	for (int i = 0; i < nb_ports; i++) {
+		struct demu_link *link = &demu_links[i];
+
+		link->params = rte_malloc("demu_link_params", sizeof(*link->params), 0);
+		if (link->params == NULL)
+			return -1;
+		*link->params = demu_default_params;
+		link->params->delayed_time = demu_port_delay[i];
+		for (int q = 0; q < DEMU_MAX_QUEUES; q++)
+			for (int c = 0; c < DEMU_MAX_CLASSES; c++)
+				link->rxq[q][c].state_4 = 1;
+
+		ports[i].link = link;
+		for (int e = 0; e < nb_ports; e++)
+			if (demu_switch ? e != i : e == (i ^ 1))
+				link->path[e] = link;
+	}
+
+	return 0;
+}
+
+/* Context of the direction received on portid, or NULL */
+static struct demu_link *
+demu_link_lookup(unsigned long portid)
+{
+	for (int i = 0; i < nb_ports; i++)
+		if (ports[i].portid == portid)
+			return &demu_links[i];
+
+	return NULL;
+}
+
+/*
+ * Parse "key=value[,key=value...]" into p. The keys take the same units
+ * as the global options: delay, jitter [us], jitter-corr, loss, dup [%],
+ * ge (-r:-g [%]), fifo (0 or 1) and rate. ber, ber-mode (drop or
+ * corrupt) and ber-csum (0 or 1) model bit errors. slot and slot-jitter
+ * [us], slot-pkts and slot-bytes release packets in aggregates.
+ * reorder [%], reorder-corr [%] and reorder-gap [packets] send some
+ * packets early. The bottleneck queue keys are aqm (droptail, red,
+ * codel or fq_codel), ecn (0 or 1), limit [packets], limit-bytes,
+ * target and interval [us], red-min and red-max [packets] and red-prob
+ * [%]. p may be modified even when an error is returned.
+ */
+static int
+demu_parse_link_params(struct demu_link_params *p, const char *arg)
+{
+	char s[256];
+	char *kv[16];
+	char *key, *value, *end;
+	int64_t val, val2;
+	double dval;
+	int i, n;
+
+	snprintf(s, sizeof(s), "%s", arg);
+	n = rte_strsplit(s, sizeof(s), kv, RTE_DIM(kv), ',');
+	if (n <= 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		key = kv[i];
+		value = strchr(key, '=');
+		if (value == NULL)
+			return -1;
+		*value++ = '\0';
+
+		if (!strcmp(key, "delay")) {
+			val = strtoul(value, &end, 0);
+			if (end == value || *end != '\0')
+				return -1;
+			p->delayed_time = demu_us_to_tsc(val);
+		} else if (!strcmp(key, "jitter")) {
+			dval = strtod(value, &end);
+			if (end == value || *end != '\0' || dval < 0)
+				return -1;
+			p->jitter_time = (uint64_t)(dval * rte_get_tsc_hz() / US_PER_S);
+		} else if (!strcmp(key, "jitter-corr")) {
+			dval = strtod(value, &end);
+			if (end == value || *end != '\0' || dval < 0 || dval > 100)
+				return -1;
+			p->jitter_corr = (uint32_t)(dval / 100 * UINT32_MAX);
+		} else if (!strcmp(key, "fifo")) {
+			p->jitter_fifo = strtoul(value, NULL, 0) != 0;
+		} else if (!strcmp(key, "loss")) {
+			val = loss_random(value);
+			if (val < 0)
+				return -1;
+			p->loss_percent_1 = val;
+			p->loss_mode = val ? LOSS_MODE_RANDOM : LOSS_MODE_NONE;
+		} else if (!strcmp(key, "ge")) {
+			end = strchr(value, ':');
+			if (end == NULL)
+				return -1;
+			*end++ = '\0';
+			val = loss_random(value);
+			val2 = loss_random(end);
+			if (val < 0 || val2 < 0)
+				return -1;
+			p->loss_percent_1 = val;
+			p->loss_percent_2 = val2;
+			p->loss_mode = LOSS_MODE_GE;
+		} else if (!strcmp(key, "dup")) {
+			val = loss_random(value);
+			if (val < 0)
+				return -1;
+			p->dup_rate = val;
+		} else if (!strcmp(key, "rate")) {
+			val = demu_parse_speed(value);
+			if (val < 0)
+				return -1;
+			p->limit_speed = val;
+		} else if (!strcmp(key, "ber")) {
+			dval = strtod(value, &end);
+			if (end == value || *end != '\0' || dval < 0 || dval >= 1)
+				return -1;
+			p->ber = dval;
+			p->ber_table = NULL;
+			if (dval > 0) {
+				p->ber_table = demu_ber_table_get(dval);
+				if (p->ber_table == NULL)
+					return -1;
+			}
+		} else if (!strcmp(key, "ber-mode")) {
+			if (!strcmp(value, "drop"))
+				p->ber_corrupt = false;
+			else if (!strcmp(value, "corrupt"))
+				p->ber_corrupt = true;
+			else
+				return -1;
+		} else if (!strcmp(key, "ber-csum")) {
+			p->ber_csum = strtoul(value, NULL, 0) != 0;
+		} else if (!strcmp(key, "slot") || !strcmp(key, "slot-jitter")) {
+			val = strtoul(value, &end, 0);
+			if (end == value || *end != '\0')
+				return -1;
+			if (!strcmp(key, "slot"))
+				p->slot_time = demu_us_to_tsc(val);
+			else
+				p->slot_jitter = demu_us_to_tsc(val);
+		} else if (!strcmp(key, "slot-pkts") || !strcmp(key, "slot-bytes")) {
+			val = strtoul(value, &end, 0);
+			if (end == value || *end != '\0' || val > UINT32_MAX)
+				return -1;
+			if (!strcmp(key, "slot-pkts"))
+				p->slot_pkts = val;
+			else
+				p->slot_bytes = val;
+		} else if (!strcmp(key, "reorder")) {
+			val = loss_random(value);
+			if (val < 0)
+				return -1;
+			p->reorder_rate = val;
+		} else if (!strcmp(key, "reorder-corr")) {
+			dval = strtod(value, &end);
+			if (end == value || *end != '\0' || dval < 0 || dval > 100)
+				return -1;
+			p->reorder_corr = (uint32_t)(dval / 100 * UINT32_MAX);
+		} else if (!strcmp(key, "reorder-gap")) {
+			val = strtoul(value, &end, 0);
+			if (end == value || *end != '\0' || val == 0 || val > UINT32_MAX)
+				return -1;
+			p->reorder_gap = val;
+		} else if (!strcmp(key, "aqm")) {
+			if (!strcmp(value, "droptail"))
+				p->aqm = DEMU_AQM_DROPTAIL;
+			else if (!strcmp(value, "red"))
+				p->aqm = DEMU_AQM_RED;
+			else if (!strcmp(value, "codel"))
+				p->aqm = DEMU_AQM_CODEL;
+			else if (!strcmp(value, "fq_codel"))
+				p->aqm = DEMU_AQM_FQ_CODEL;
+			else
+				return -1;
+		} else if (!strcmp(key, "ecn")) {
+			p->ecn = strtoul(value, NULL, 0) != 0;
+		} else if (!strcmp(key, "limit")) {
+			val = strtoul(value, &end, 0);
+			if (end == value || *end != '\0' || val > UINT32_MAX)
+				return -1;
+			p->queue_limit = val;
+		} else if (!strcmp(key, "limit-bytes")) {
+			val = strtoul(value, &end, 0);
+			if (end == value)
+				return -1;
+			if (*end == 'k' || *end == 'K')
+				val *= 1000, end++;
+			else if (*end == 'm' || *end == 'M')
+				val *= 1000 * 1000, end++;
+			if (*end != '\0')
+				return -1;
+			p->queue_limit_bytes = val;
+		} else if (!strcmp(key, "target") || !strcmp(key, "interval")) {
+			val = strtoul(value, &end, 0);
+			if (end == value || *end != '\0' || val == 0)
+				return -1;
+			if (key[0] == 't')
+				p->aqm_target = demu_us_to_tsc(val);
+			else
+				p->aqm_interval = demu_us_to_tsc(val);
+		} else if (!strcmp(key, "red-min") || !strcmp(key, "red-max")) {
+			val = strtoul(value, &end, 0);
+			if (end == value || *end != '\0' || val > UINT32_MAX)
+				return -1;
+			if (!strcmp(key, "red-min"))
+				p->red_min = val;
+			else
+				p->red_max = val;
+		} else if (!strcmp(key, "red-prob")) {
+			dval = strtod(value, &end);
+			if (end == value || *end != '\0' || dval < 0 || dval > 100)
+				return -1;
+			p->red_prob = (uint32_t)(dval / 100 * UINT32_MAX);
+		} else
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse "portid:key=value[,key=value...]", which overrides the impairments
+ * of the packets received on portid (and sent out of its peer).
+ */
+static int
+demu_parse_link(const char *arg)
+{
+	struct demu_link *link;
+	unsigned long portid;
+	char *end;
+
+	portid = strtoul(arg, &end, 0);
+	if (end == arg || *end != ':')
+		return -1;
+	link = demu_link_lookup(portid);
+	if (link == NULL)
+		return -1;
+
+	return demu_parse_link_params(link->params, end + 1);
+}
+
+/*
+ * Compile the profile file path for link. Each line of the file is
+ *
+ *   TIME_MS key=value[,key=value...]
+ *
+ * with the keys of --link. From TIME_MS after the start, the link uses
+ * the parameters of the previous line modified by the line (the first
+ * line modifies the parameters given by the options). A line
+ * "TIME_MS repeat" restarts the profile at TIME_MS. Empty lines and
+ * lines starting with '#' are ignored.
+ */
+static int
+demu_profile_load(struct demu_link *link, const char *path)
+{
+	struct demu_profile *pr;
+	struct stat st;
+	const char *map, *line, *eol, *mapend;
+	char buf[256];
+	char *kvs, *end;
+	uint32_t max_entries, n;
+	uint64_t t;
+	double ms;
+	int fd, ret = -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	mapend = map + st.st_size;
+
+	max_entries = 1;
+	for (line = map; line < mapend; line++)
+		if (*line == '\n')
+			max_entries++;
+
+	pr = rte_zmalloc("demu_profile", sizeof(*pr), 0);
+	if (pr == NULL)
+		goto out;
+	pr->start = rte_malloc("demu_profile", sizeof(*pr->start) * max_entries, 0);
+	pr->entries = rte_malloc("demu_profile",
+			sizeof(*pr->entries) * max_entries, RTE_CACHE_LINE_SIZE);
+	if (pr->start == NULL || pr->entries == NULL)
+		goto out;
+
+	/* entry 0 holds the parameters given by the options */
+	pr->start[0] = 0;
+	pr->entries[0] = *link->params;
+	n = 1;
+
+	for (line = map; line < mapend; line = eol + 1) {
+		eol = memchr(line, '\n', mapend - line);
+		if (eol == NULL)
+			eol = mapend;
+		if ((size_t)(eol - line) >= sizeof(buf))
+			goto out;
+		snprintf(buf, sizeof(buf), "%.*s", (int)(eol - line), line);
+
+		kvs = buf + strspn(buf, " \t");
+		if (*kvs == '\0' || *kvs == '#' || *kvs == '\r')
+			continue;
+		ms = strtod(kvs, &end);
+		if (end == kvs || ms < 0 || pr->period)
+			goto out;
+		t = (uint64_t)(ms * rte_get_tsc_hz() / MS_PER_S);
+		if (t < pr->start[n - 1])
+			goto out;
+		kvs = end + strspn(end, " \t");
+		kvs[strcspn(kvs, " \t\r")] = '\0';
+
+		if (!strcmp(kvs, "repeat")) {
+			if (t <= pr->start[n - 1])
+				goto out;
+			pr->period = t;
+			continue;
+		}
+		/* a change at the time of the previous one amends it */
+		if (t > pr->start[n - 1]) {
+			pr->start[n] = t;
+			pr->entries[n] = pr->entries[n - 1];
+			n++;
+		}
+		if (demu_parse_link_params(&pr->entries[n - 1], kvs) < 0)
+			goto out;
+	}
+	pr->nb_entries = n;
+	pr->next = UINT64_MAX;
+
+	rte_free(link->params);
+	link->params = &pr->entries[0];
+	link->profile = pr;
+	RTE_LOG(INFO, DEMU, "Profile %s: %u changes%s\n", path, n - 1,
+			pr->period ? ", repeated" : "");
+	ret = 0;
+out:
+	if (ret < 0 && pr != NULL) {
+		rte_free(pr->start);
+		rte_free(pr->entries);
+		rte_free(pr);
+	}
+	munmap((void *)(uintptr_t)map, st.st_size);
+
+	return ret;
+}
+
+/* Parse "portid:path" */
+static int
+demu_parse_profile(const char *arg)
+{
+	struct demu_link *link;
+	unsigned long portid;
+	char *end;
+
+	portid = strtoul(arg, &end, 0);
+	if (end == arg || *end != ':')
+		return -1;
+	link = demu_link_lookup(portid);
+	if (link == NULL || link->profile != NULL)
+		return -1;
+
+	return demu_profile_load(link, end + 1);
+}
+
+/*
+ * Load the Mahimahi trace path for link: one line per delivery
+ * opportunity, with the millisecond of the opportunity in increasing
+ * order. The trace repeats after the millisecond of its last line.
+ */
+static int
+demu_trace_load(struct demu_link *link, const char *path)
+{
+	struct demu_trace *tr;
+	struct stat st;
+	const char *map, *p, *mapend;
+	uint32_t max_entries, n;
+	unsigned long ms;
+	int fd, ret = -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	mapend = map + st.st_size;
+
+	max_entries = 1;
+	for (p = map; p < mapend; p++)
+		if (*p == '\n')
+			max_entries++;
+
+	tr = rte_zmalloc("demu_trace", sizeof(*tr), 0);
+	if (tr == NULL)
+		goto out;
+	tr->entries = rte_malloc("demu_trace", sizeof(*tr->entries) * max_entries, 0);
+	if (tr->entries == NULL)
+		goto out;
+
+	n = 0;
+	for (p = map; p < mapend; p++) {
+		if (isspace((unsigned char)*p))
+			continue;
+		if (!isdigit((unsigned char)*p))
+			goto out;
+		ms = 0;
+		while (p < mapend && isdigit((unsigned char)*p)) {
+			ms = ms * 10 + (*p - '0');
+			if (ms > UINT32_MAX)
+				goto out;
+			p++;
+		}
+		if (n > 0 && ms < tr->entries[n - 1].ms)
+			goto out;
+		if (n > 0 && ms == tr->entries[n - 1].ms) {
+			tr->entries[n - 1].nb_opp++;
+		} else {
+			tr->entries[n].ms = ms;
+			tr->entries[n].nb_opp = 1;
+			n++;
+		}
+		if (p < mapend && !isspace((unsigned char)*p))
+			goto out;
+	}
+	if (n == 0 || tr->entries[n - 1].ms == 0)
+		goto out;
+	tr->nb_entries = n;
+	tr->period = tr->entries[n - 1].ms;
+	tr->next = UINT64_MAX;
+
+	link->trace = tr;
+	RTE_LOG(INFO, DEMU, "Trace %s: %u ms\n", path, tr->period);
+	ret = 0;
+out:
+	if (ret < 0 && tr != NULL) {
+		rte_free(tr->entries);
+		rte_free(tr);
+	}
+	munmap((void *)(uintptr_t)map, st.st_size);
+
+	return ret;
+}
+
+/* Parse "portid:path" */
+static int
+demu_parse_trace(const char *arg)
+{
+	struct demu_link *link;
+	unsigned long portid;
+	char *end;
+
+	portid = strtoul(arg, &end, 0);
+	if (end == arg || *end != ':')
+		return -1;
+	link = demu_link_lookup(portid);
+	if (link == NULL || link->trace != NULL)
+		return -1;
+
+	return demu_trace_load(link, end + 1);
+}
+
+/*
+ * Parse "in:out:key=value[,key=value...]", which gives the packets
+ * switched from port in to port out the parameters of in modified by
+ * the keys.
+ */
+static int
+demu_parse_path(const char *arg)
+{
+	struct demu_link *link, *out, *path;
+	unsigned long in_portid, out_portid;
+	char *end;
+
+	in_portid = strtoul(arg, &end, 0);
+	if (end == arg || *end != ':')
+		return -1;
+	arg = end + 1;
+	out_portid = strtoul(arg, &end, 0);
+	if (end == arg || *end != ':')
+		return -1;
+	link = demu_link_lookup(in_portid);
+	out = demu_link_lookup(out_portid);
+	if (!demu_switch || link == NULL || out == NULL || link == out ||
+			link->path[out - demu_links] != link)
+		return -1;
+
+	path = rte_zmalloc("demu_link", sizeof(*path), RTE_CACHE_LINE_SIZE);
+	if (path == NULL)
+		return -1;
+	path->params = rte_malloc("demu_link_params", sizeof(*path->params), 0);
+	if (path->params == NULL) {
+		rte_free(path);
+		return -1;
+	}
+	*path->params = *link->params;
+	if (demu_parse_link_params(path->params, end + 1) < 0) {
+		rte_free(path->params);
+		rte_free(path);
+		return -1;
+	}
+	for (int q = 0; q < DEMU_MAX_QUEUES; q++)
+		path->rxq[q][0].state_4 = 1;
+	link->path[out - demu_links] = path;
+
+	return 0;
+}
+
+/* Parse "portid:MAC", a static FDB entry */
+static int
+demu_parse_fdb(const char *arg)
+{
+	struct ether_addr addr;
+	struct demu_link *link;
+	unsigned long portid;
+	unsigned int b[ETHER_ADDR_LEN];
+	char *end;
+	int len;
+
+	portid = strtoul(arg, &end, 0);
+	if (end == arg || *end != ':')
+		return -1;
+	link = demu_link_lookup(portid);
+	if (!demu_switch || link == NULL)
+		return -1;
+	if (sscanf(end + 1, "%2x:%2x:%2x:%2x:%2x:%2x%n", &b[0], &b[1], &b[2],
+				&b[3], &b[4], &b[5], &len) != ETHER_ADDR_LEN || end[1 + len] != '\0')
+		return -1;
+	for (int i = 0; i < ETHER_ADDR_LEN; i++)
+		addr.addr_bytes[i] = b[i];
+	if (is_multicast_ether_addr(&addr))
+		return -1;
+	demu_fdb_learn(demu_fdb_key(&addr), demu_fdb_hash(demu_fdb_key(&addr)),
+			link - demu_links, DEMU_FDB_STATIC);
+
+	return 0;
+}
+
+/* Parse "key=value[,key=value...]" of the generator */
+static int
+demu_parse_gen(const char *arg)
+{
+	struct demu_gen_conf *c = &demu_gen_conf;
+	char s[256];
+	char *kv[8], *sizes[DEMU_GEN_MAX_SIZES];
+	char *key, *value, *end;
+	unsigned long val;
+	double dval;
+	int i, n, nb_sizes;
+
+	snprintf(s, sizeof(s), "%s", arg);
+	n = rte_strsplit(s, sizeof(s), kv, RTE_DIM(kv), ',');
+	if (n <= 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		key = kv[i];
+		value = strchr(key, '=');
+		if (value == NULL)
+			return -1;
+		*value++ = '\0';
+
+		if (!strcmp(key, "rate")) {
+			dval = strtod(value, &end);
+			if (*end == 'k' || *end == 'K') {
+				dval *= 1e3;
+				end++;
+			} else if (*end == 'm' || *end == 'M') {
+				dval *= 1e6;
+				end++;
+			}
+			if (end == value || *end != '\0' || dval < 0 || dval > 1e9)
+				return -1;
+			c->rate = (uint64_t)dval;
+		} else if (!strcmp(key, "size")) {
+			nb_sizes = rte_strsplit(value, strlen(value) + 1, sizes, RTE_DIM(sizes), ':');
+			if (nb_sizes <= 0)
+				return -1;
+			c->nb_sizes = nb_sizes;
+			for (unsigned k = 0; k < c->nb_sizes; k++) {
+				val = strtoul(sizes[k], &end, 10);
+				if (end == sizes[k] || *end != '\0' ||
+						val < DEMU_GEN_MIN_SIZE || val > DEMU_GEN_MAX_SIZE)
+					return -1;
+				c->sizes[k] = val;
+			}
+		} else if (!strcmp(key, "flows")) {
+			val = strtoul(value, &end, 10);
+			if (end == value || *end != '\0' || val == 0 ||
+					val > UINT16_MAX - DEMU_GEN_UDP_PORT)
+				return -1;
+			c->flows = val;
+		} else if (!strcmp(key, "time")) {
+			val = strtoul(value, &end, 10);
+			if (end == value || *end != '\0')
+				return -1;
+			c->time = val;
+		} else
+			return -1;
+	}
+	demu_gen = true;
+
+	return 0;
+}
+
+/* Parse "FILE[,snaplen=N][,sample=N]" of the capture */
+static int
+demu_parse_capture(const char *arg)
+{
+	static char s[PATH_MAX];
+	char *kv[3];
+	char *key, *value, *end;
+	unsigned long val;
+	int i, n;
+
+	if (strlen(arg) >= sizeof(s))
+		return -1;
+	snprintf(s, sizeof(s), "%s", arg);
+	n = rte_strsplit(s, sizeof(s), kv, RTE_DIM(kv), ',');
+	if (n <= 0 || kv[0][0] == '\0')
+		return -1;
+
+	for (i = 1; i < n; i++) {
+		key = kv[i];
+		value = strchr(key, '=');
+		if (value == NULL)
+			return -1;
+		*value++ = '\0';
+		val = strtoul(value, &end, 10);
+		if (end == value || *end != '\0')
+			return -1;
+
+		if (!strcmp(key, "snaplen")) {
+			if (val < ETHER_HDR_LEN || val > UINT16_MAX)
+				return -1;
+			demu_cap_snaplen = val;
+		} else if (!strcmp(key, "sample")) {
+			if (val == 0 || val > UINT32_MAX)
+				return -1;
+			demu_cap_sample = val;
+		} else
+			return -1;
+	}
+	demu_cap_path = kv[0];
+
+	return 0;
+}
+
+/* --class arguments, indexed by class */
+static const char *demu_class_args[DEMU_MAX_CLASSES];
+
+/* Parse "class:key=value[,key=value...]" */
+static int
+demu_parse_class(const char *arg)
 {
-	char *end = NULL;
-	unsigned long pm;
+	unsigned long cls;
+	char *end;
 
-	/* parse hexadecimal string */
-	pm = strtoul(portmask, &end, 16);
-	if ((portmask[0] == '\0') || (end == NULL) || (*end != '\0'))
+	cls = strtoul(arg, &end, 0);
+	if (end == arg || *end != ':' || cls == 0 || cls >= DEMU_MAX_CLASSES)
+		return -1;
+	demu_class_args[cls] = end + 1;
+
+	return 0;
+}
+
+/*
+ * Give each direction the parameters of the classes: those of the
+ * direction modified by --class. The rate of the direction is applied
+ * at TX to all its classes, so a class only keeps its own.
+ */
+static int
+demu_classes_init(void)
+{
+	for (int i = 0; i < nb_ports; i++) {
+		struct demu_link *link = &demu_links[i];
+
+		for (int c = 1; c < DEMU_MAX_CLASSES; c++) {
+			struct demu_link_params *p;
+
+			if (demu_class_args[c] == NULL)
+				continue;
+			p = rte_malloc("demu_class_params", sizeof(*p), 0);
+			if (p == NULL)
+				return -1;
+			*p = *link->params;
+			p->limit_speed = 0;
+			if (demu_parse_link_params(p, demu_class_args[c]) < 0) {
+				rte_free(p);
+				return -1;
+			}
+			link->class_params[c] = p;
+		}
+	}
+
+	return 0;
+}
+
+/* Parse "A.B.C.D[/len]" into a MASK field */
+static int
+demu_parse_acl_addr(struct rte_acl_field *f, char *value)
+{
+	struct in_addr addr;
+	char *len, *end;
+	unsigned long n = 32;
+
+	len = strchr(value, '/');
+	if (len != NULL) {
+		*len++ = '\0';
+		n = strtoul(len, &end, 10);
+		if (end == len || *end != '\0' || n > 32)
+			return -1;
+	}
+	if (inet_pton(AF_INET, value, &addr) != 1)
+		return -1;
+	f->value.u32 = rte_be_to_cpu_32(addr.s_addr);
+	f->mask_range.u32 = n;
+
+	return 0;
+}
+
+/* Parse "N[-M]" into a RANGE field */
+static int
+demu_parse_acl_port(struct rte_acl_field *f, const char *value)
+{
+	unsigned long lo, hi;
+	char *end;
+
+	lo = strtoul(value, &end, 10);
+	if (end == value || lo > UINT16_MAX)
+		return -1;
+	hi = lo;
+	if (*end == '-') {
+		value = end + 1;
+		hi = strtoul(value, &end, 10);
+		if (end == value || hi > UINT16_MAX || hi < lo)
+			return -1;
+	}
+	if (*end != '\0')
+		return -1;
+	f->value.u16 = lo;
+	f->mask_range.u16 = hi;
+
+	return 0;
+}
+
+/*
+ * Parse "key=value[,key=value...]" into the fields of r. The keys are
+ * proto (tcp, udp, icmp or a number), src and dst (A.B.C.D[/len]),
+ * sport and dport (N[-M]) and dscp. A missing key matches anything.
+ */
+static int
+demu_parse_acl_rule(struct demu_acl_rule *r, const char *arg)
+{
+	char s[256];
+	char *kv[8];
+	char *key, *value, *end;
+	unsigned long val;
+	int i, n;
+
+	r->field[DEMU_ACL_SPORT].mask_range.u16 = UINT16_MAX;
+	r->field[DEMU_ACL_DPORT].mask_range.u16 = UINT16_MAX;
+
+	snprintf(s, sizeof(s), "%s", arg);
+	n = rte_strsplit(s, sizeof(s), kv, RTE_DIM(kv), ',');
+	if (n <= 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		key = kv[i];
+		value = strchr(key, '=');
+		if (value == NULL)
+			return -1;
+		*value++ = '\0';
+
+		if (!strcmp(key, "proto")) {
+			if (!strcmp(value, "tcp"))
+				val = IPPROTO_TCP;
+			else if (!strcmp(value, "udp"))
+				val = IPPROTO_UDP;
+			else if (!strcmp(value, "icmp"))
+				val = IPPROTO_ICMP;
+			else {
+				val = strtoul(value, &end, 0);
+				if (end == value || *end != '\0' || val > UINT8_MAX)
+					return -1;
+			}
+			r->field[DEMU_ACL_PROTO].value.u8 = val;
+			r->field[DEMU_ACL_PROTO].mask_range.u8 = UINT8_MAX;
+		} else if (!strcmp(key, "src")) {
+			if (demu_parse_acl_addr(&r->field[DEMU_ACL_SRC], value) < 0)
+				return -1;
+		} else if (!strcmp(key, "dst")) {
+			if (demu_parse_acl_addr(&r->field[DEMU_ACL_DST], value) < 0)
+				return -1;
+		} else if (!strcmp(key, "sport")) {
+			if (demu_parse_acl_port(&r->field[DEMU_ACL_SPORT], value) < 0)
+				return -1;
+		} else if (!strcmp(key, "dport")) {
+			if (demu_parse_acl_port(&r->field[DEMU_ACL_DPORT], value) < 0)
+				return -1;
+		} else if (!strcmp(key, "dscp")) {
+			val = strtoul(value, &end, 0);
+			if (end == value || *end != '\0' || val > 63)
+				return -1;
+			r->field[DEMU_ACL_TOS].value.u8 = val << 2;
+			r->field[DEMU_ACL_TOS].mask_range.u8 = 0xfc;
+		} else
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Rules of a --rules file */
+#define DEMU_MAX_RULES 16384
+static const char *demu_rules_path;
+
+/*
+ * Build demu_acl_ctx from the rules file path. Each line is
+ *
+ *   CLASS key=value[,key=value...]
+ *
+ * with the keys of demu_parse_acl_rule(). A packet takes the class of
+ * the first line it matches. Empty lines and lines starting with '#'
+ * are ignored. The context is built on socket, that of the RX lcores
+ * which classify with it.
+ */
+static int
+demu_rules_load(const char *path, int socket)
+{
+	struct rte_acl_param param = {
+		.name = "demu_acl",
+		.socket_id = socket,
+		.rule_size = RTE_ACL_RULE_SZ(DEMU_ACL_NUM_FIELDS),
+		.max_rule_num = DEMU_MAX_RULES,
+	};
+	struct rte_acl_config cfg = {
+		.num_categories = 1,
+		.num_fields = DEMU_ACL_NUM_FIELDS,
+	};
+	struct demu_acl_rule rule;
+	FILE *fp;
+	char line[512];
+	char *cls, *kvs, *end, *save;
+	unsigned long c;
+	int n = 0, lineno = 0, ret = -1;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	demu_acl_ctx = rte_acl_create(&param);
+	if (demu_acl_ctx == NULL)
+		goto out;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		cls = strtok_r(line, " \t\r\n", &save);
+		if (cls == NULL || cls[0] == '#')
+			continue;
+		kvs = strtok_r(NULL, " \t\r\n", &save);
+		c = strtoul(cls, &end, 0);
+		if (end == cls || *end != '\0' || c == 0 || c >= DEMU_MAX_CLASSES ||
+				kvs == NULL || n == DEMU_MAX_RULES) {
+			RTE_LOG(ERR, DEMU, "%s:%d: invalid rule\n", path, lineno);
+			goto out;
+		}
+
+		memset(&rule, 0, sizeof(rule));
+		if (demu_parse_acl_rule(&rule, kvs) < 0) {
+			RTE_LOG(ERR, DEMU, "%s:%d: invalid rule\n", path, lineno);
+			goto out;
+		}
+		rule.data.category_mask = 1;
+		rule.data.priority = RTE_ACL_MAX_PRIORITY - lineno;
+		rule.data.userdata = c;
+		if (rte_acl_add_rules(demu_acl_ctx, (struct rte_acl_rule *)&rule, 1) < 0)
+			goto out;
+		n++;
+	}
+	if (n == 0) {
+		RTE_LOG(ERR, DEMU, "%s: no rules\n", path);
+		goto out;
+	}
+
+	memcpy(cfg.defs, demu_acl_defs, sizeof(demu_acl_defs));
+	if (rte_acl_build(demu_acl_ctx, &cfg) < 0)
+		goto out;
+	demu_class_max_backlog = demu_us_to_tsc(DEMU_CLASS_MAX_BACKLOG_US);
+	RTE_LOG(INFO, DEMU, "%d classification rules loaded from %s\n", n, path);
+	ret = 0;
+out:
+	if (ret < 0 && demu_acl_ctx != NULL) {
+		rte_acl_free(demu_acl_ctx);
+		demu_acl_ctx = NULL;
+	}
+	fclose(fp);
+
+	return ret;
+}
+
+/* Whether any parameters link can take have a jitter */
+static bool
+demu_link_has_jitter(const struct demu_link *link)
+{
+	for (int c = 1; c < DEMU_MAX_CLASSES; c++)
+		if (link->class_params[c] && link->class_params[c]->jitter_time)
+			return true;
+	for (int e = 0; e < nb_ports; e++)
+		if (link->path[e] != NULL && link->path[e] != link &&
+				demu_link_has_jitter(link->path[e]))
+			return true;
+	if (link->profile == NULL)
+		return link->params->jitter_time != 0;
+	for (uint32_t i = 0; i < link->profile->nb_entries; i++)
+		if (link->profile->entries[i].jitter_time)
+			return true;
+
+	return false;
+}
+
+/* Highest speed portid supports in bps, 10G if it does not tell */
+static uint64_t
+demu_port_speed(uint8_t portid)
+{
+	static const struct {
+		uint32_t capa;
+		uint64_t bps;
+	} speeds[] = {
+		{ETH_LINK_SPEED_100G, 100000000000ULL},
+		{ETH_LINK_SPEED_56G, 56000000000ULL},
+		{ETH_LINK_SPEED_50G, 50000000000ULL},
+		{ETH_LINK_SPEED_40G, 40000000000ULL},
+		{ETH_LINK_SPEED_25G, 25000000000ULL},
+		{ETH_LINK_SPEED_20G, 20000000000ULL},
+		{ETH_LINK_SPEED_10G, 10000000000ULL},
+		{ETH_LINK_SPEED_5G, 5000000000ULL},
+		{ETH_LINK_SPEED_2_5G, 2500000000ULL},
+		{ETH_LINK_SPEED_1G, 1000000000ULL},
+	};
+	struct rte_eth_dev_info dev_info;
+
+	rte_eth_dev_info_get(portid, &dev_info);
+	for (unsigned i = 0; i < RTE_DIM(speeds); i++)
+		if (dev_info.speed_capa & speeds[i].capa)
+			return speeds[i].bps;
+
+	return 10000000000ULL;
+}
+
+/*
+ * Bytes link can have in flight: its rate (or the speed of the port it
+ * is received on, if it has no rate) during its longest delay. A jitter
+ * table entry is at most INT16_MAX / DEMU_DIST_SCALE times the jitter.
+ */
+static double
+demu_link_bdp_one(const struct demu_link *link, int i)
+{
+	const struct demu_link_params *p = link->params;
+	uint32_t n = 1;
+	double bdp = 0;
+
+	if (link->profile != NULL) {
+		p = link->profile->entries;
+		n = link->profile->nb_entries;
+	}
+	for (uint32_t e = 0; e < n; e++) {
+		uint64_t rate = p[e].limit_speed;
+		double delay = p[e].delayed_time +
+			(double)p[e].jitter_time * INT16_MAX / DEMU_DIST_SCALE;
+
+		if (rate == 0 || link->trace != NULL)
+			rate = demu_port_speed(ports[i].portid);
+		bdp = RTE_MAX(bdp, rate / 8.0 * delay / rte_get_tsc_hz());
+	}
+	/* a class also holds up to DEMU_CLASS_MAX_BACKLOG_US before its delay */
+	for (int c = 1; c < DEMU_MAX_CLASSES; c++) {
+		const struct demu_link_params *cp = link->class_params[c];
+		double delay;
+
+		if (cp == NULL)
+			continue;
+		delay = cp->delayed_time + demu_class_max_backlog +
+			(double)cp->jitter_time * INT16_MAX / DEMU_DIST_SCALE;
+		bdp = RTE_MAX(bdp, demu_port_speed(ports[i].portid) / 8.0 * delay / rte_get_tsc_hz());
+	}
+
+	return bdp;
+}
+
+/* Bytes direction i can have in flight, on the path that holds the most */
+static double
+demu_link_bdp(int i)
+{
+	const struct demu_link *link = &demu_links[i];
+	double bdp = demu_link_bdp_one(link, i);
+
+	for (int e = 0; e < nb_ports; e++)
+		if (link->path[e] != NULL && link->path[e] != link)
+			bdp = RTE_MAX(bdp, demu_link_bdp_one(link->path[e], i));
+
+	return bdp;
+}
+
+/*
+ * Nodes of the bottleneck queue of each pipeline of link: enough for the
+ * largest limit it can take, in minimum-sized frames for a limit in
+ * bytes, plus a TX ring to drop from when it is full. Beyond that, TX
+ * leaves the packets in the delay line.
+ */
+static uint32_t
+demu_link_queue_nodes(const struct demu_link *link)
+{
+	const struct demu_link_params *p = link->params;
+	uint64_t nodes = 0;
+	uint32_t n = 1;
+
+	if (link->profile != NULL) {
+		p = link->profile->entries;
+		n = link->profile->nb_entries;
+	}
+	for (uint32_t e = 0; e < n; e++) {
+		uint64_t pkts = p[e].queue_limit;
+
+		if (p[e].queue_limit_bytes)
+			pkts = RTE_MIN(pkts ? pkts : UINT64_MAX,
+					p[e].queue_limit_bytes / ETHER_MIN_LEN);
+		if (pkts == 0)
+			pkts = (uint64_t)DEMU_BQ_MAX_NODES * nb_queues;
+		nodes = RTE_MAX(nodes, pkts / nb_queues + DEMU_SEND_BUFFER_SIZE_PKTS);
+	}
+
+	return RTE_MIN(RTE_MAX(nodes, (uint64_t)DEMU_BQ_MIN_NODES), (uint64_t)DEMU_BQ_MAX_NODES);
+}
+
+/* Capacity of the delay line of each pipeline of direction i */
+static uint32_t demu_delayed_pkts[RTE_MAX_ETHPORTS];
+
+/*
+ * Size the delay lines and create the pools. A delay line holds the BDP
+ * of its direction in minimum-sized frames. The small pool holds the
+ * same, and the MTU pool holds the BDP in frames just too large to be
+ * small, plus what can be held by the NIC rings (or the rings of the
+ * generator), the TX rings and bottleneck queues of each path, and the
+ * rings of the capture taps. So a packet is only dropped by a full
+ * delay line or queue, never for lack of mbufs.
+ *
+ * Jumbo frames take several mbufs, but fewer per byte than frames just
+ * too large to be small, so the BDP term covers them. The rings and
+ * queues, which are sized in packets, hold the mbufs of the largest
+ * frame for each of their packets.
+ */
+static int
+demu_buffer_init(void)
+{
+	double small_pkts[RTE_MAX_NUMA_NODES] = {0};
+	double large_pkts[RTE_MAX_NUMA_NODES] = {0};
+	uint64_t tx_pkts[RTE_MAX_NUMA_NODES] = {0};
+	unsigned nb_pipelines[RTE_MAX_NUMA_NODES] = {0};
+	unsigned segs = demu_frame_segs();
+	char name[RTE_MEMPOOL_NAMESIZE];
+	uint32_t n;
+
+	/* a packet is in the pools of the node of the port it is received on */
+	for (int i = 0; i < nb_ports; i++) {
+		unsigned socket = ports[i].socket;
+		double bdp = demu_link_bdp(i);
+		double pkts = bdp / (ETHER_MIN_LEN + DEMU_WIRE_OVERHEAD);
+
+		n = RTE_MAX((uint32_t)RTE_MIN(pkts / nb_queues, (double)(1U << 30)),
+				(uint32_t)DEMU_MIN_DELAYED_PKTS);
+		demu_delayed_pkts[i] = rte_align32pow2(n);
+		small_pkts[socket] += pkts;
+		large_pkts[socket] += bdp / (DEMU_SMALL_PKT_SIZE + 1 + DEMU_WIRE_OVERHEAD);
+		nb_pipelines[socket] += nb_queues;
+		for (int e = 0; e < nb_ports; e++)
+			if (demu_links[i].path[e] != NULL)
+				tx_pkts[socket] += (uint64_t)nb_queues * (DEMU_SEND_BUFFER_SIZE_PKTS +
+						demu_link_queue_nodes(demu_links[i].path[e]));
+		RTE_LOG(INFO, DEMU, "Port %u: %.1f MB in flight, delay line of %u packets per queue\n",
+				ports[i].portid, bdp / 1e6, demu_delayed_pkts[i]);
+	}
+
+	for (unsigned socket = 0; socket < RTE_MAX_NUMA_NODES; socket++) {
+		if (nb_pipelines[socket] == 0)
+			continue;
+
+		n = (uint32_t)RTE_MIN(large_pkts[socket], (double)(1U << 30)) +
+			nb_pipelines[socket] * (nb_rxd + nb_txd) + tx_pkts[socket] * segs +
+			(demu_gen ? nb_pipelines[socket] * 2 * DEMU_GEN_RING_SIZE * segs : 0) +
+			(demu_cap_path ? nb_pipelines[socket] * 2 * DEMU_CAP_RING_SIZE * segs : 0) +
+			rte_lcore_count() * MEMPOOL_CACHE_SIZE + DEMU_MIN_DELAYED_PKTS;
+		snprintf(name, sizeof(name), "mbuf_pool_%u", socket);
+		demu_pktmbuf_pool[socket] = rte_pktmbuf_pool_create(name, n,
+				MEMPOOL_CACHE_SIZE, 0, MEMPOOL_BUF_SIZE, socket);
+		if (demu_pktmbuf_pool[socket] == NULL)
+			return -1;
+		RTE_LOG(INFO, DEMU, "Socket %u: MTU pool of %u mbufs (%u MB)\n", socket, n,
+				(unsigned)((uint64_t)n * (MEMPOOL_BUF_SIZE + sizeof(struct rte_mbuf)) >> 20));
+
+		n = (uint32_t)RTE_MIN(small_pkts[socket], (double)(1U << 30)) +
+			(demu_cap_path ? nb_pipelines[socket] * 2 * DEMU_CAP_RING_SIZE : 0) +
+			rte_lcore_count() * MEMPOOL_CACHE_SIZE + DEMU_MIN_DELAYED_PKTS;
+		snprintf(name, sizeof(name), "mbuf_pool_small_%u", socket);
+		demu_small_pool[socket] = rte_pktmbuf_pool_create(name, n,
+				MEMPOOL_CACHE_SIZE, 0, DEMU_SMALL_BUF_SIZE, socket);
+		if (demu_small_pool[socket] == NULL)
+			return -1;
+		RTE_LOG(INFO, DEMU, "Socket %u: small pool of %u mbufs (%u MB)\n", socket, n,
+				(unsigned)((uint64_t)n * (DEMU_SMALL_BUF_SIZE + sizeof(struct rte_mbuf)) >> 20));
+	}
+
+	for (int i = 0; i < nb_ports; i++)
+		ports[i].small_pool = demu_small_pool[ports[i].socket];
+
+	return 0;
+}
+
+/* NUMA node of portid, 0 if it is unknown */
+static unsigned
+demu_port_socket(uint8_t portid)
+{
+	int socket = rte_eth_dev_socket_id(portid);
+
+	return socket < 0 ? 0 : (unsigned)socket;
+}
+
+/* An unused lcore, on socket if there is one left, or RTE_MAX_LCORE */
+static unsigned
+demu_lcore_pick(bool *used, unsigned socket)
+{
+	unsigned lcore_id, any = RTE_MAX_LCORE;
+
+	RTE_LCORE_FOREACH(lcore_id) {
+		if (used[lcore_id])
+			continue;
+		if (rte_lcore_to_socket_id(lcore_id) == socket) {
+			used[lcore_id] = true;
+			return lcore_id;
+		}
+		if (any == RTE_MAX_LCORE)
+			any = lcore_id;
+	}
+	if (any != RTE_MAX_LCORE)
+		used[any] = true;
+
+	return any;
+}
+
+/* Run a task of type for pipeline queue of port index i on lcore_id */
+static int
+demu_task_add(enum thread_type_t type, uint8_t i, uint16_t queue, unsigned lcore_id)
+{
+	struct demu_task *t;
+
+	if (demu_nb_tasks == DEMU_MAX_TASKS)
+		return -1;
+	t = &demu_tasks[demu_nb_tasks];
+	t->type = type;
+	t->port_idx = i;
+	t->queue = queue;
+	t->lcore_id = lcore_id;
+	if (type == TIMER || type == GEN || type == CAPTURE) {
+		demu_nb_tasks++;
+		return 0;
+	}
+
+	if (rte_lcore_to_socket_id(lcore_id) != ports[i].socket)
+		RTE_LOG(WARNING, DEMU, "%s lcore %u of port %u queue %u is on "
+				"socket %u, the port on socket %u\n",
+				demu_task_names[type], lcore_id, ports[i].portid, queue,
+				rte_lcore_to_socket_id(lcore_id), ports[i].socket);
+	t->stats = demu_stats_task(demu_nb_tasks, ports[i].portid);
+	/* TX sends the packets received on the peer port, or on several ports of a switch */
+	if (type == TX)
+		t->hist = demu_hist_task(demu_nb_tasks,
+				demu_switch ? ports[i].portid : ports[i ^ 1].portid);
+	if (type == WORKER) {
+		t->worker = rte_zmalloc_socket("demu_worker", sizeof(*t->worker),
+				RTE_CACHE_LINE_SIZE, ports[i].socket);
+		if (t->worker == NULL)
+			return -1;
+	}
+	if (demu_cap_path != NULL && type != WORKER) {
+		t->cap = demu_dq_create(DEMU_CAP_RING_SIZE, ports[i].socket);
+		if (t->cap == NULL)
+			return -1;
+	}
+	demu_nb_tasks++;
+
+	return 0;
+}
+
+/*
+ * Run pipeline queue of port index i to completion on lcore_id: its RX
+ * and worker, and the TX queue its packets leave from (the peer port),
+ * or the TX queue of the port itself on a switch.
+ */
+static int
+demu_task_add_rtc(uint8_t i, uint16_t queue, unsigned lcore_id)
+{
+	if (demu_task_add(RX, i, queue, lcore_id) < 0 ||
+			demu_task_add(WORKER, i, queue, lcore_id) < 0 ||
+			demu_task_add(TX, demu_switch ? i : i ^ 1, queue, lcore_id) < 0)
+		return -1;
+
+	return 0;
+}
+
+static const char *demu_lcore_map;
+
+/*
+ * Parse the --lcore-map "LCORE=ROLE[+ROLE...][,LCORE=...]" into tasks,
+ * where ROLE is timer, gen, capture, or rx, worker, tx or rtc followed by
+ * ":PORTID[.QUEUE]" (every queue if QUEUE is not given).
+ */
+static int
+demu_lcore_map_parse(const char *arg)
+{
+	static const char *const roles[] = {
+		[RX] = "rx", [TX] = "tx", [WORKER] = "worker", [TIMER] = "timer",
+		[GEN] = "gen", [CAPTURE] = "capture",
+	};
+	char buf[1024], *entry, *role, *save_entry, *save_role, *end;
+	unsigned long lcore_id, portid, queue;
+	struct demu_link *link;
+	uint16_t q_first, q_last;
+	unsigned type;
+
+	if (strlen(arg) >= sizeof(buf))
+		return -1;
+	strcpy(buf, arg);
+
+	for (entry = strtok_r(buf, ",", &save_entry); entry != NULL;
+			entry = strtok_r(NULL, ",", &save_entry)) {
+		lcore_id = strtoul(entry, &end, 10);
+		if (end == entry || *end != '=' || lcore_id >= RTE_MAX_LCORE ||
+				!rte_lcore_is_enabled(lcore_id))
+			return -1;
+
+		for (role = strtok_r(end + 1, "+", &save_role); role != NULL;
+				role = strtok_r(NULL, "+", &save_role)) {
+			end = strchr(role, ':');
+			if (end != NULL)
+				*end++ = '\0';
+			for (type = 0; type < RTE_DIM(roles); type++)
+				if (!strcmp(role, roles[type]))
+					break;
+			if (type == TIMER || type == GEN || type == CAPTURE) {
+				if (end != NULL || demu_task_add(type, 0, 0, lcore_id) < 0)
+					return -1;
+				continue;
+			}
+			if (end == NULL || (type == RTE_DIM(roles) && strcmp(role, "rtc")))
+				return -1;
+
+			portid = strtoul(end, &end, 10);
+			link = demu_link_lookup(portid);
+			if (link == NULL)
+				return -1;
+			q_first = 0;
+			q_last = nb_queues - 1;
+			if (*end == '.') {
+				queue = strtoul(end + 1, &end, 10);
+				if (queue >= nb_queues)
+					return -1;
+				q_first = q_last = queue;
+			}
+			if (*end != '\0')
+				return -1;
+
+			for (uint16_t q = q_first; q <= q_last; q++) {
+				if (type == RTE_DIM(roles) ?
+						demu_task_add_rtc(link - demu_links, q, lcore_id) < 0 :
+						demu_task_add(type, link - demu_links, q, lcore_id) < 0)
+					return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Whether every stage of every pipeline and the timer run exactly once,
+ * and the generator and the capture writer if there are
+ */
+static bool
+demu_tasks_complete(void)
+{
+	static uint8_t runs[TIMER][RTE_MAX_ETHPORTS][DEMU_MAX_QUEUES];
+	unsigned timers = 0, gens = 0, caps = 0;
+	bool ok = true;
+
+	memset(runs, 0, sizeof(runs));
+	for (unsigned i = 0; i < demu_nb_tasks; i++) {
+		const struct demu_task *t = &demu_tasks[i];
+
+		if (t->type == TIMER)
+			timers++;
+		else if (t->type == GEN)
+			gens++;
+		else if (t->type == CAPTURE)
+			caps++;
+		else
+			runs[t->type][t->port_idx][t->queue]++;
+	}
+	if (timers != 1) {
+		RTE_LOG(ERR, DEMU, "The timer runs on %u lcores instead of one\n", timers);
+		ok = false;
+	}
+	if (gens != (demu_gen ? 1 : 0)) {
+		RTE_LOG(ERR, DEMU, "The generator runs on %u lcores instead of %u\n",
+				gens, demu_gen ? 1 : 0);
+		ok = false;
+	}
+	if (caps != (demu_cap_path != NULL ? 1 : 0)) {
+		RTE_LOG(ERR, DEMU, "The capture writer runs on %u lcores instead of %u\n",
+				caps, demu_cap_path != NULL ? 1 : 0);
+		ok = false;
+	}
+	for (unsigned type = RX; type < TIMER; type++)
+		for (int i = 0; i < nb_ports; i++)
+			for (uint16_t q = 0; q < nb_queues; q++)
+				if (runs[type][i][q] != 1) {
+					RTE_LOG(ERR, DEMU, "%s of port %u queue %u runs on %u lcores "
+							"instead of one\n", demu_task_names[type],
+							ports[i].portid, q, runs[type][i][q]);
+					ok = false;
+				}
+
+	return ok;
+}
+
+/*
+ * Assign the tasks to the lcores: as --lcore-map tells, or else give each
+ * pipeline an RX, a worker and a TX lcore on the NUMA node of its port,
+ * and the lcore left over to the timer. Without enough lcores for that,
+ * the pipelines of the directions are run to completion, shared round
+ * robin by the lcores but the one of the timer. The generator and the
+ * capture writer get an lcore of their own if one is left, or share the
+ * one of the timer. Warn about every placement that crosses nodes.
+ */
+static int
+demu_lcore_assign(void)
+{
+	static const enum thread_type_t types[] = {RX, WORKER, TX};
+	const struct {
+		enum thread_type_t type;
+		bool enabled;
+	} aux[] = {
+		{GEN, demu_gen},
+		{CAPTURE, demu_cap_path != NULL},
+	};
+	bool used[RTE_MAX_LCORE] = {false};
+	unsigned lcore_id, nb_lcores_dedicated = nb_ports * nb_queues * 3 + 1;
+	unsigned lcores[RTE_MAX_LCORE], n = 0, k = 0, timer_lcore;
+
+	for (int i = 0; i < nb_ports; i += 2)
+		if (!demu_switch && ports[i].socket != ports[i + 1].socket)
+			RTE_LOG(WARNING, DEMU, "Ports %u and %u are on different sockets, "
+					"packets cross sockets between them\n",
+					ports[i].portid, ports[i + 1].portid);
+
+	if (demu_lcore_map != NULL) {
+		if (demu_lcore_map_parse(demu_lcore_map) < 0) {
+			RTE_LOG(ERR, DEMU, "Invalid lcore map %s\n", demu_lcore_map);
+			return -1;
+		}
+		return demu_tasks_complete() ? 0 : -1;
+	}
+
+	if (rte_lcore_count() >= nb_lcores_dedicated) {
+		for (int i = 0; i < nb_ports; i++)
+			for (uint16_t q = 0; q < nb_queues; q++)
+				for (unsigned t = 0; t < RTE_DIM(types); t++)
+					if (demu_task_add(types[t], i, q,
+								demu_lcore_pick(used, ports[i].socket)) < 0)
+						return -1;
+		timer_lcore = demu_lcore_pick(used, 0);
+		if (demu_task_add(TIMER, 0, 0, timer_lcore) < 0)
+			return -1;
+		for (unsigned t = 0; t < RTE_DIM(aux); t++) {
+			if (!aux[t].enabled)
+				continue;
+			lcore_id = demu_lcore_pick(used, 0);
+			if (demu_task_add(aux[t].type, 0, 0,
+						lcore_id == RTE_MAX_LCORE ? timer_lcore : lcore_id) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	RTE_LOG(INFO, DEMU, "%u lcores for %u, running the pipelines to completion\n",
+			rte_lcore_count(), nb_lcores_dedicated);
+	timer_lcore = demu_lcore_pick(used, 0);
+	if (demu_task_add(TIMER, 0, 0, timer_lcore) < 0)
 		return -1;
+	for (unsigned t = 0; t < RTE_DIM(aux); t++)
+		if (aux[t].enabled && demu_task_add(aux[t].type, 0, 0, timer_lcore) < 0)
+			return -1;
+	RTE_LCORE_FOREACH(lcore_id)
+		if (!used[lcore_id])
+			lcores[n++] = lcore_id;
+	/* with a single lcore, the timer shares it */
+	if (n == 0)
+		lcores[n++] = timer_lcore;
+	for (int i = 0; i < nb_ports; i++)
+		for (uint16_t q = 0; q < nb_queues; q++)
+			if (demu_task_add_rtc(i, q, lcores[k++ % n]) < 0)
+				return -1;
+
+	return 0;
+}
+
+/*
+ * Control socket.
+ *
+ * With --ctrl PATH, a thread serves line based commands on a Unix stream
+ * socket, one client at a time:
+ *
+ *   show [portid]                         parameters of one or all directions
+ *   set portid key=value[,key=value...]   same keys as --link
+ *   stats                                 counters of each port
+ *
+ * Each reply ends with a line "OK" or "ERROR reason". The thread runs on
+ * the CPUs left to the EAL lcores (see demu_ctrl_cpuset()), never on
+ * the CPU of a data path or timer lcore, which it would preempt.
+ */
+static const char *demu_ctrl_path;
+static pthread_t demu_ctrl_thread;
+
+static const char *const demu_aqm_names[] = {
+	[DEMU_AQM_DROPTAIL] = "droptail",
+	[DEMU_AQM_RED] = "red",
+	[DEMU_AQM_CODEL] = "codel",
+	[DEMU_AQM_FQ_CODEL] = "fq_codel",
+};
 
-	return pm;
+static void
+demu_ctrl_show(FILE *out, const struct demu_link *link, uint8_t portid)
+{
+	const struct demu_link_params *p = link->params;
+	double tsc_per_us = (double)rte_get_tsc_hz() / US_PER_S;
+
+	fprintf(out, "%u:delay=%.0f,jitter=%.3f,jitter-corr=%.2f,fifo=%d,",
+			portid, p->delayed_time / tsc_per_us, p->jitter_time / tsc_per_us,
+			p->jitter_corr * 100.0 / UINT32_MAX, p->jitter_fifo);
+	if (p->loss_mode == LOSS_MODE_GE)
+		fprintf(out, "ge=%.6f:%.6f,", p->loss_percent_1 * 100.0 / RANDOM_MAX,
+				p->loss_percent_2 * 100.0 / RANDOM_MAX);
+	else
+		fprintf(out, "loss=%.6f,", p->loss_mode == LOSS_MODE_NONE ? 0 :
+				p->loss_percent_1 * 100.0 / RANDOM_MAX);
+	fprintf(out, "dup=%.6f,rate=%" PRIu64 "K,", p->dup_rate * 100.0 / RANDOM_MAX,
+			p->limit_speed / 1000);
+	fprintf(out, "ber=%g,ber-mode=%s,ber-csum=%d,", p->ber,
+			p->ber_corrupt ? "corrupt" : "drop", p->ber_csum);
+	fprintf(out, "slot=%.0f,slot-jitter=%.0f,slot-pkts=%u,slot-bytes=%u,",
+			p->slot_time / tsc_per_us, p->slot_jitter / tsc_per_us,
+			p->slot_pkts, p->slot_bytes);
+	fprintf(out, "reorder=%.6f,reorder-corr=%.2f,reorder-gap=%u,",
+			p->reorder_rate * 100.0 / RANDOM_MAX,
+			p->reorder_corr * 100.0 / UINT32_MAX, p->reorder_gap);
+	fprintf(out, "aqm=%s,ecn=%d,limit=%u,limit-bytes=%" PRIu64 ",target=%.0f,"
+			"interval=%.0f,red-min=%u,red-max=%u,red-prob=%.2f\n",
+			demu_aqm_names[p->aqm], p->ecn, p->queue_limit, p->queue_limit_bytes,
+			p->aqm_target / tsc_per_us, p->aqm_interval / tsc_per_us,
+			p->red_min, p->red_max, p->red_prob * 100.0 / UINT32_MAX);
 }
 
+/*
+ * Replace the parameters of link with a copy modified by kvs. The data
+ * path picks up the new copy at its next burst, and the old one is freed
+ * once no lcore can still be reading it.
+ */
 static int
-demu_parse_port_pairs(const char *q_arg)
+demu_ctrl_set(struct demu_link *link, const char *kvs)
 {
-	char s[256];
-	const char *p, *p0 = q_arg;
-	char *end;
-	enum fieldnames {
-		FLD_PORT = 0,
-		FLD_PORT_OTHER,
-		FLD_DELAYED_TIME,
-		_NUM_FLD
-	};
-	unsigned long int_fld[_NUM_FLD];
-	char *str_fld[_NUM_FLD];
-	int i;
-	unsigned size;
+	struct demu_link_params *old = link->params;
+	struct demu_link_params *p;
+
+	/* the timer lcore owns the parameters of a link with a profile */
+	if (link->profile != NULL)
+		return -EBUSY;
+
+	p = rte_malloc("demu_link_params", sizeof(*p), 0);
+	if (p == NULL)
+		return -ENOMEM;
+	*p = *old;
+	if (demu_parse_link_params(p, kvs) < 0) {
+		rte_free(p);
+		return -EINVAL;
+	}
+	if (p->jitter_time && jitter_table == NULL && demu_dist_init() < 0) {
+		rte_free(p);
+		return -EINVAL;
+	}
 
-	nb_ports = 0;
+	__atomic_store_n(&link->params, p, __ATOMIC_SEQ_CST);
+	demu_qsbr_synchronize();
+	rte_free(old);
 
-	while ((p = strchr(p0,'(')) != NULL) {
-		++p;
-		if((p0 = strchr(p,')')) == NULL)
-			return -1;
+	return 0;
+}
 
-		size = p0 - p;
-		if(size >= sizeof(s))
-			return -1;
+static void
+demu_ctrl_command(FILE *out, char *line)
+{
+	struct demu_link *link;
+	char *cmd, *arg, *kvs, *save;
+	unsigned long portid;
+	char *end;
+	int ret;
 
-		snprintf(s, sizeof(s), "%.*s", size, p);
-		if (rte_strsplit(s, sizeof(s), str_fld, _NUM_FLD, ',') != _NUM_FLD)
-			return -1;
+	cmd = strtok_r(line, " \t\r\n", &save);
+	arg = strtok_r(NULL, " \t\r\n", &save);
+	kvs = strtok_r(NULL, " \t\r\n", &save);
+	if (cmd == NULL)
+		return;
 
-		for (i = 0; i < _NUM_FLD; i++){
-			errno = 0;
-			int_fld[i] = strtoul(str_fld[i], &end, 0);
-			if (end == str_fld[i])
-				return -1;
+	if (arg != NULL) {
+		portid = strtoul(arg, &end, 0);
+		link = demu_link_lookup(portid);
+		if (end == arg || *end != '\0' || link == NULL) {
+			fprintf(out, "ERROR unknown port %s\n", arg);
+			return;
 		}
+	} else {
+		portid = 0;
+		link = NULL;
+	}
 
-		if (nb_ports > RTE_MAX_ETHPORTS) {
-			printf("exceeded max number of ports: %hu\n",
-				nb_ports);
-			return -1;
+	if (!strcmp(cmd, "show")) {
+		for (int i = 0; i < nb_ports; i++)
+			if (link == NULL || link == &demu_links[i])
+				demu_ctrl_show(out, &demu_links[i], ports[i].portid);
+		fprintf(out, "OK\n");
+	} else if (!strcmp(cmd, "set")) {
+		if (link == NULL || kvs == NULL) {
+			fprintf(out, "ERROR usage: set portid key=value[,key=value...]\n");
+			return;
 		}
+		ret = demu_ctrl_set(link, kvs);
+		if (ret == -EBUSY) {
+			fprintf(out, "ERROR port %lu follows a profile\n", portid);
+			return;
+		} else if (ret < 0) {
+			fprintf(out, "ERROR invalid value %s\n", kvs);
+			return;
+		}
+		RTE_LOG(INFO, DEMU, "Port %lu set to %s\n", portid, kvs);
+		fprintf(out, "OK\n");
+	} else if (!strcmp(cmd, "stats")) {
+		demu_stats_print(out);
+		fprintf(out, "OK\n");
+	} else if (!strcmp(cmd, "help")) {
+		fprintf(out, "show [portid]\nset portid key=value[,key=value...]\nstats\n"
+				"keys: delay, jitter, jitter-corr, fifo, loss, ge, dup, rate,\n"
+				"  aqm, ecn, limit, limit-bytes, target, interval, red-min,\n"
+				"  red-max, red-prob,\n"
+				"  reorder, reorder-corr, reorder-gap,\n"
+				"  ber, ber-mode, ber-csum,\n"
+				"  slot, slot-jitter, slot-pkts, slot-bytes\nOK\n");
+	} else
+		fprintf(out, "ERROR unknown command %s\n", cmd);
+}
 
-		uint64_t delayed_time = \
-			((rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S) * \
-			int_fld[FLD_DELAYED_TIME];
-
-		ports[nb_ports].portid = (uint8_t)int_fld[FLD_PORT];
-		ports[nb_ports].delayed_time = delayed_time;
-		++nb_ports;
+static void *
+demu_ctrl_loop(void *arg)
+{
+	int sock = (int)(intptr_t)arg;
+	char line[512];
+	FILE *in, *out;
+	int fd;
 
-		ports[nb_ports].portid = (uint8_t)int_fld[FLD_PORT_OTHER];
-		ports[nb_ports].delayed_time = delayed_time;
-		++nb_ports;
+	while (!force_quit) {
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0)
+			continue;
+		in = fdopen(fd, "r");
+		out = fdopen(dup(fd), "w");
+		if (in == NULL || out == NULL) {
+			if (in != NULL)
+				fclose(in);
+			else
+				close(fd);
+			if (out != NULL)
+				fclose(out);
+			continue;
+		}
+		setvbuf(out, NULL, _IOLBF, 0);
+		while (!force_quit && fgets(line, sizeof(line), in) != NULL)
+			demu_ctrl_command(out, line);
+		fclose(out);
+		fclose(in);
 	}
 
-	return 0;
+	return NULL;
 }
 
-static int64_t
-demu_parse_speed(const char *arg)
+/*
+ * The online CPUs that no EAL lcore runs on, or all of them if every
+ * CPU runs one.
+ */
+static void
+demu_ctrl_cpuset(cpu_set_t *set)
 {
-	int64_t speed, base;
-	char *end = NULL;
-
-	speed = strtoul(arg, &end, 10);
-	if (end != NULL) {
-		char unit = *end;
+	long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned lcore_id;
 
-		switch (unit) {
-			case 'k':
-			case 'K':
-				base = 1000;
-				break;
-			case 'm':
-			case 'M':
-				base = 1000 * 1000;
-				break;
-			case 'g':
-			case 'G':
-				if (speed > 10) return -1;
-				base = 1000 * 1000 * 1000;
-				break;
-			default:
-				return -1;
-		}
-		end++;
+	CPU_ZERO(set);
+	for (long cpu = 0; cpu < nb_cpus && cpu < CPU_SETSIZE; cpu++)
+		CPU_SET(cpu, set);
+	RTE_LCORE_FOREACH(lcore_id) {
+		for (long cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &lcore_config[lcore_id].cpuset))
+				CPU_CLR(cpu, set);
+	}
+	if (CPU_COUNT(set) == 0) {
+		RTE_LOG(WARNING, DEMU, "No CPU left for the control thread, "
+				"a set may delay the lcore it runs on\n");
+		for (long cpu = 0; cpu < nb_cpus && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, set);
 	}
+}
 
-	if (arg[0] == '\0' || end == NULL || *end != '\0') {
+static int
+demu_ctrl_init(const char *path)
+{
+	struct sockaddr_un addr;
+	pthread_attr_t attr;
+	cpu_set_t cpuset;
+	int sock, ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 1) < 0) {
+		close(sock);
 		return -1;
 	}
 
-	speed = speed * base;
-	if (speed < 1000 && 10000000000 < speed)
+	/* not the affinity of the master lcore, which runs a task */
+	demu_ctrl_cpuset(&cpuset);
+	pthread_attr_init(&attr);
+	pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+	ret = pthread_create(&demu_ctrl_thread, &attr, demu_ctrl_loop, (void *)(intptr_t)sock);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		close(sock);
 		return -1;
+	}
+	rte_thread_setname(demu_ctrl_thread, "demu-ctrl");
+	RTE_LOG(INFO, DEMU, "Control socket listening on %s\n", path);
 
-	return speed;
+	return 0;
 }
 
+#define CMD_LINE_OPT_JITTER_DIST "jitter-dist"
+#define CMD_LINE_OPT_JITTER_CORR "jitter-corr"
+#define CMD_LINE_OPT_JITTER_FIFO "jitter-fifo"
+#define CMD_LINE_OPT_SEED "seed"
+#define CMD_LINE_OPT_LINK "link"
+#define CMD_LINE_OPT_CTRL "ctrl"
+#define CMD_LINE_OPT_PROFILE "profile"
+#define CMD_LINE_OPT_TRACE "trace"
+#define CMD_LINE_OPT_CLASS "class"
+#define CMD_LINE_OPT_RULES "rules"
+#define CMD_LINE_OPT_SWITCH "switch"
+#define CMD_LINE_OPT_PATH "path"
+#define CMD_LINE_OPT_FDB "fdb"
+#define CMD_LINE_OPT_IDLE_SLEEP "idle-sleep"
+#define CMD_LINE_OPT_LCORE_MAP "lcore-map"
+#define CMD_LINE_OPT_GEN "gen"
+#define CMD_LINE_OPT_CAPTURE "capture"
+#define CMD_LINE_OPT_MTU "mtu"
+enum {
+	/* long options mapped to a short option */
+
+	/* first long only option value must be >= 256, so that we won't
+	 * conflict with short options */
+	CMD_LINE_OPT_MIN_NUM = 256,
+	CMD_LINE_OPT_JITTER_DIST_NUM,
+	CMD_LINE_OPT_JITTER_CORR_NUM,
+	CMD_LINE_OPT_JITTER_FIFO_NUM,
+	CMD_LINE_OPT_SEED_NUM,
+	CMD_LINE_OPT_LINK_NUM,
+	CMD_LINE_OPT_CTRL_NUM,
+	CMD_LINE_OPT_PROFILE_NUM,
+	CMD_LINE_OPT_TRACE_NUM,
+	CMD_LINE_OPT_CLASS_NUM,
+	CMD_LINE_OPT_RULES_NUM,
+	CMD_LINE_OPT_SWITCH_NUM,
+	CMD_LINE_OPT_PATH_NUM,
+	CMD_LINE_OPT_FDB_NUM,
+	CMD_LINE_OPT_IDLE_SLEEP_NUM,
+	CMD_LINE_OPT_LCORE_MAP_NUM,
+	CMD_LINE_OPT_GEN_NUM,
+	CMD_LINE_OPT_CAPTURE_NUM,
+	CMD_LINE_OPT_MTU_NUM,
+};
+
 /* Parse the argument given in the command line of the application */
 static int
 demu_parse_args(int argc, char **argv)
@@ -633,14 +6118,46 @@ demu_parse_args(int argc, char **argv)
 	char **argvopt;
 	char *prgname = argv[0];
 	const struct option longopts[] = {
+		{CMD_LINE_OPT_JITTER_DIST, 1, 0, CMD_LINE_OPT_JITTER_DIST_NUM},
+		{CMD_LINE_OPT_JITTER_CORR, 1, 0, CMD_LINE_OPT_JITTER_CORR_NUM},
+		{CMD_LINE_OPT_JITTER_FIFO, 0, 0, CMD_LINE_OPT_JITTER_FIFO_NUM},
+		{CMD_LINE_OPT_SEED, 1, 0, CMD_LINE_OPT_SEED_NUM},
+		{CMD_LINE_OPT_LINK, 1, 0, CMD_LINE_OPT_LINK_NUM},
+		{CMD_LINE_OPT_CTRL, 1, 0, CMD_LINE_OPT_CTRL_NUM},
+		{CMD_LINE_OPT_PROFILE, 1, 0, CMD_LINE_OPT_PROFILE_NUM},
+		{CMD_LINE_OPT_TRACE, 1, 0, CMD_LINE_OPT_TRACE_NUM},
+		{CMD_LINE_OPT_CLASS, 1, 0, CMD_LINE_OPT_CLASS_NUM},
+		{CMD_LINE_OPT_RULES, 1, 0, CMD_LINE_OPT_RULES_NUM},
+		{CMD_LINE_OPT_SWITCH, 0, 0, CMD_LINE_OPT_SWITCH_NUM},
+		{CMD_LINE_OPT_PATH, 1, 0, CMD_LINE_OPT_PATH_NUM},
+		{CMD_LINE_OPT_FDB, 1, 0, CMD_LINE_OPT_FDB_NUM},
+		{CMD_LINE_OPT_IDLE_SLEEP, 1, 0, CMD_LINE_OPT_IDLE_SLEEP_NUM},
+		{CMD_LINE_OPT_LCORE_MAP, 1, 0, CMD_LINE_OPT_LCORE_MAP_NUM},
+		{CMD_LINE_OPT_GEN, 1, 0, CMD_LINE_OPT_GEN_NUM},
+		{CMD_LINE_OPT_CAPTURE, 1, 0, CMD_LINE_OPT_CAPTURE_NUM},
+		{CMD_LINE_OPT_MTU, 1, 0, CMD_LINE_OPT_MTU_NUM},
 		{0, 0, 0, 0}
 	};
 	int longindex = 0;
 	int64_t val;
+	double dval;
+	char *end;
+	const char *link_args[RTE_MAX_ETHPORTS];
+	int nb_link_args = 0;
+	const char *profile_args[RTE_MAX_ETHPORTS];
+	int nb_profile_args = 0;
+	const char *trace_args[RTE_MAX_ETHPORTS];
+	int nb_trace_args = 0;
+	const char *path_args[RTE_MAX_ETHPORTS * RTE_MAX_ETHPORTS];
+	int nb_path_args = 0;
+	const char *fdb_args[DEMU_FDB_MAX_STATIC];
+	int nb_fdb_args = 0;
 
 	argvopt = argv;
+	demu_default_params.aqm_target = demu_us_to_tsc(DEMU_CODEL_TARGET_US);
+	demu_default_params.aqm_interval = demu_us_to_tsc(DEMU_CODEL_INTERVAL_US);
 
-	while ((opt = getopt_long(argc, argvopt, "g:p:P:r:s:D:h:",
+	while ((opt = getopt_long(argc, argvopt, "g:j:p:P:q:r:s:D:h:",
 					longopts, &longindex)) != EOF) {
 
 		switch (opt) {
@@ -663,6 +6180,17 @@ demu_parse_args(int argc, char **argv)
 				}
 				break;
 
+			/* number of queues */
+			case 'q':
+				val = strtol(optarg, NULL, 10);
+				if (val < 1 || val > DEMU_MAX_QUEUES) {
+					printf("Invalid value: number of queues\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				nb_queues = val;
+				break;
+
 			/* random packet loss */
 			case 'r':
 				val = loss_random(optarg);
@@ -671,8 +6199,8 @@ demu_parse_args(int argc, char **argv)
 					demu_usage(prgname);
 					return -1;
 				}
-				loss_percent_1 = val;
-				loss_mode = LOSS_MODE_RANDOM;
+				demu_default_params.loss_percent_1 = val;
+				demu_default_params.loss_mode = LOSS_MODE_RANDOM;
 				break;
 
 			case 'g':
@@ -682,8 +6210,8 @@ demu_parse_args(int argc, char **argv)
 					demu_usage(prgname);
 					return -1;
 				}
-				loss_percent_2 = val;
-				loss_mode = LOSS_MODE_GE;
+				demu_default_params.loss_percent_2 = val;
+				demu_default_params.loss_mode = LOSS_MODE_GE;
 				break;
 
 			/* duplicate packet */
@@ -694,7 +6222,7 @@ demu_parse_args(int argc, char **argv)
 					demu_usage(prgname);
 					return -1;
 				}
-				dup_rate = val;
+				demu_default_params.dup_rate = val;
 				break;
 
 			/* bandwidth limitation */
@@ -704,7 +6232,161 @@ demu_parse_args(int argc, char **argv)
 					RTE_LOG(ERR, DEMU, "Invalid value: speed\n");
 					return -1;
 				}
-				limit_speed = val;
+				demu_default_params.limit_speed = val;
+				break;
+
+			/* delay jitter */
+			case 'j':
+				dval = strtod(optarg, &end);
+				if (end == optarg || *end != '\0' || dval < 0) {
+					printf("Invalid value: jitter\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				demu_default_params.jitter_time = (uint64_t)(dval * rte_get_tsc_hz() / US_PER_S);
+				break;
+
+			case CMD_LINE_OPT_JITTER_DIST_NUM:
+				jitter_dist = optarg;
+				break;
+
+			case CMD_LINE_OPT_JITTER_CORR_NUM:
+				dval = strtod(optarg, &end);
+				if (end == optarg || *end != '\0' || dval < 0 || dval > 100) {
+					printf("Invalid value: jitter correlation\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				demu_default_params.jitter_corr = (uint32_t)(dval / 100 * UINT32_MAX);
+				break;
+
+			case CMD_LINE_OPT_JITTER_FIFO_NUM:
+				demu_default_params.jitter_fifo = true;
+				break;
+
+			case CMD_LINE_OPT_SEED_NUM:
+				demu_rand_seed = strtoull(optarg, &end, 0);
+				if (end == optarg || *end != '\0') {
+					printf("Invalid value: seed\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				demu_rand_seed_set = true;
+				break;
+
+			/* per-direction impairments, applied after the global ones */
+			case CMD_LINE_OPT_LINK_NUM:
+				if (nb_link_args == RTE_MAX_ETHPORTS) {
+					printf("Too many --%s options\n", CMD_LINE_OPT_LINK);
+					return -1;
+				}
+				link_args[nb_link_args++] = optarg;
+				break;
+
+			/* control socket */
+			case CMD_LINE_OPT_CTRL_NUM:
+				demu_ctrl_path = optarg;
+				break;
+
+			/* time-varying impairments, applied after --link */
+			case CMD_LINE_OPT_PROFILE_NUM:
+				if (nb_profile_args == RTE_MAX_ETHPORTS) {
+					printf("Too many --%s options\n", CMD_LINE_OPT_PROFILE);
+					return -1;
+				}
+				profile_args[nb_profile_args++] = optarg;
+				break;
+
+			/* delivery opportunity shaping */
+			case CMD_LINE_OPT_TRACE_NUM:
+				if (nb_trace_args == RTE_MAX_ETHPORTS) {
+					printf("Too many --%s options\n", CMD_LINE_OPT_TRACE);
+					return -1;
+				}
+				trace_args[nb_trace_args++] = optarg;
+				break;
+
+			/* per-class impairments, applied after --link */
+			case CMD_LINE_OPT_CLASS_NUM:
+				if (demu_parse_class(optarg) < 0) {
+					printf("Invalid value: class %s\n", optarg);
+					demu_usage(prgname);
+					return -1;
+				}
+				break;
+
+			/* classification rules */
+			case CMD_LINE_OPT_RULES_NUM:
+				demu_rules_path = optarg;
+				break;
+
+			/* one switch of all the ports instead of pairs */
+			case CMD_LINE_OPT_SWITCH_NUM:
+				demu_switch = true;
+				break;
+
+			/* per-path impairments of the switch, applied after --link */
+			case CMD_LINE_OPT_PATH_NUM:
+				if (nb_path_args == (int)RTE_DIM(path_args)) {
+					printf("Too many --%s options\n", CMD_LINE_OPT_PATH);
+					return -1;
+				}
+				path_args[nb_path_args++] = optarg;
+				break;
+
+			/* static FDB entries of the switch */
+			case CMD_LINE_OPT_FDB_NUM:
+				if (nb_fdb_args == (int)RTE_DIM(fdb_args)) {
+					printf("Too many --%s options\n", CMD_LINE_OPT_FDB);
+					return -1;
+				}
+				fdb_args[nb_fdb_args++] = optarg;
+				break;
+
+			/* let idle lcores sleep */
+			case CMD_LINE_OPT_IDLE_SLEEP_NUM:
+				val = strtol(optarg, &end, 10);
+				if (end == optarg || *end != '\0' || val < 0 || val > US_PER_S) {
+					printf("Invalid value: idle sleep\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				demu_idle_sleep = demu_us_to_tsc(val);
+				break;
+
+			/* place the tasks on the lcores, parsed once the ports are known */
+			case CMD_LINE_OPT_LCORE_MAP_NUM:
+				demu_lcore_map = optarg;
+				break;
+
+			/* built-in traffic generator on ring ports */
+			case CMD_LINE_OPT_GEN_NUM:
+				if (demu_parse_gen(optarg) < 0) {
+					printf("Invalid value: gen\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				break;
+
+			/* pcapng capture of the packets received and sent */
+			case CMD_LINE_OPT_CAPTURE_NUM:
+				if (demu_parse_capture(optarg) < 0) {
+					printf("Invalid value: capture\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				break;
+
+			/* jumbo frames */
+			case CMD_LINE_OPT_MTU_NUM:
+				val = strtol(optarg, &end, 10);
+				if (end == optarg || *end != '\0' || val < ETHER_MIN_MTU ||
+						val > ETHER_MAX_JUMBO_FRAME_LEN - ETHER_HDR_LEN - ETHER_CRC_LEN) {
+					printf("Invalid value: mtu\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				demu_max_frame = val + ETHER_HDR_LEN + ETHER_CRC_LEN;
 				break;
 
 			/* long options */
@@ -722,6 +6404,70 @@ demu_parse_args(int argc, char **argv)
 		RTE_LOG(ERR, DEMU, "Option -P must be specified\n");
 		return -1;
 	}
+	for (unsigned k = 0; demu_gen && k < demu_gen_conf.nb_sizes; k++) {
+		if (demu_gen_conf.sizes[k] > demu_max_frame) {
+			printf("Invalid value: gen size %u is above the frames of --mtu\n",
+					demu_gen_conf.sizes[k]);
+			demu_usage(prgname);
+			return -1;
+		}
+	}
+
+	if (demu_links_init() < 0) {
+		RTE_LOG(ERR, DEMU, "Cannot allocate link parameters\n");
+		return -1;
+	}
+	for (int i = 0; i < nb_link_args; i++) {
+		if (demu_parse_link(link_args[i]) < 0) {
+			printf("Invalid value: link %s\n", link_args[i]);
+			demu_usage(prgname);
+			return -1;
+		}
+	}
+	for (int i = 0; i < nb_profile_args; i++) {
+		if (demu_parse_profile(profile_args[i]) < 0) {
+			printf("Invalid value: profile %s\n", profile_args[i]);
+			demu_usage(prgname);
+			return -1;
+		}
+	}
+	for (int i = 0; i < nb_trace_args; i++) {
+		if (demu_parse_trace(trace_args[i]) < 0) {
+			printf("Invalid value: trace %s\n", trace_args[i]);
+			demu_usage(prgname);
+			return -1;
+		}
+	}
+	for (int i = 0; i < nb_path_args; i++) {
+		if (demu_parse_path(path_args[i]) < 0) {
+			printf("Invalid value: path %s\n", path_args[i]);
+			demu_usage(prgname);
+			return -1;
+		}
+	}
+	for (int i = 0; i < nb_fdb_args; i++) {
+		if (demu_parse_fdb(fdb_args[i]) < 0) {
+			printf("Invalid value: fdb %s\n", fdb_args[i]);
+			demu_usage(prgname);
+			return -1;
+		}
+	}
+	if (demu_classes_init() < 0) {
+		printf("Invalid value: class\n");
+		demu_usage(prgname);
+		return -1;
+	}
+	demu_rand_init();
+
+	for (int i = 0; i < nb_ports; i++) {
+		if (!demu_link_has_jitter(&demu_links[i]))
+			continue;
+		if (demu_dist_init() < 0) {
+			RTE_LOG(ERR, DEMU, "Invalid jitter distribution: %s\n", jitter_dist);
+			return -1;
+		}
+		break;
+	}
 
 	if (optind >= 0)
 		argv[optind-1] = prgname;
@@ -810,56 +6556,108 @@ main(int argc, char **argv)
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
 
+	/* a secondary process only monitors the counters of the primary */
+	if (rte_eal_process_type() == RTE_PROC_SECONDARY)
+		return demu_stats_monitor();
+
+	if (demu_stats_init() < 0)
+		rte_exit(EXIT_FAILURE, "Cannot reserve memzone %s\n", DEMU_STATS_MZ_NAME);
+
 	/* parse application arguments (after the EAL ones) */
 	ret = demu_parse_args(argc, argv);
 	if (ret < 0)
 		rte_exit(EXIT_FAILURE, "Invalid DEMU arguments\n");
 
-	nb_lcores = rte_lcore_count();
-	uint8_t nb_lcores_required = nb_ports*3 + 1;
-	if (nb_lcores != nb_lcores_required)
-		rte_exit(EXIT_FAILURE, " %d lcores, %d ports.\n"
-				"The number of lcores should be %d (1 + 3*NUMBER_OF_PORTS).\n",
-				nb_lcores, nb_ports, nb_lcores_required);
-
-	/* create the mbuf pool */
-	demu_pktmbuf_pool = rte_pktmbuf_pool_create("mbuf_pool",
-			DEMU_DELAYED_BUFFER_PKTS + DEMU_DELAYED_BUFFER_PKTS + DEMU_SEND_BUFFER_SIZE_PKTS + DEMU_SEND_BUFFER_SIZE_PKTS,
-			MEMPOOL_CACHE_SIZE, 0, MEMPOOL_BUF_SIZE,
-			rte_socket_id());
+	if (demu_gen && demu_gen_ports_create() < 0)
+		rte_exit(EXIT_FAILURE, "Cannot create the ring ports of the generator\n");
+
+	for (int i = 0; i < nb_ports; i++)
+		ports[i].socket = demu_port_socket(ports[i].portid);
+	if (demu_lcore_assign() < 0)
+		rte_exit(EXIT_FAILURE, "Cannot assign %u lcores to %d ports of %u queues\n",
+				rte_lcore_count(), nb_ports, nb_queues);
+
+	/* one classifier for all the RX lcores, on the socket of the first */
+	if (demu_rules_path != NULL) {
+		int socket = SOCKET_ID_ANY;
 
-	if (demu_pktmbuf_pool == NULL)
+		for (unsigned i = 0; i < demu_nb_tasks; i++) {
+			if (demu_tasks[i].type == RX) {
+				socket = rte_lcore_to_socket_id(demu_tasks[i].lcore_id);
+				break;
+			}
+		}
+		if (demu_rules_load(demu_rules_path, socket) < 0)
+			rte_exit(EXIT_FAILURE, "Invalid rules %s\n", demu_rules_path);
+	}
+
+	/* size the delay lines and create the mbuf pools */
+	if (demu_buffer_init() < 0)
 		rte_exit(EXIT_FAILURE, "Cannot init mbuf pool\n");
 
+	if (nb_queues > 1)
+		port_conf.rxmode.mq_mode = ETH_MQ_RX_RSS;
+	if (demu_max_frame > ETHER_MAX_LEN) {
+		port_conf.rxmode.jumbo_frame = 1;
+		port_conf.rxmode.max_rx_pkt_len = demu_max_frame;
+	}
+	/* frames larger than an mbuf are received and sent in chains of mbufs */
+	if (demu_frame_segs() > 1) {
+		port_conf.rxmode.enable_scatter = 1;
+		tx_conf.txq_flags &= ~ETH_TXQ_FLAGS_NOMULTSEGS;
+	}
+
 	/* Initialise each port */
 	for (int i = 0; i < nb_ports; i++) {
 		/* init port */
 		uint8_t portid = ports[i].portid;
+		struct rte_eth_dev_info dev_info;
+		struct rte_eth_conf local_port_conf = port_conf;
 
 		RTE_LOG(INFO, DEMU, "Initializing port %u\n", (unsigned) portid);
-		ret = rte_eth_dev_configure(portid, 1, 1, &port_conf);
+		rte_eth_dev_info_get(portid, &dev_info);
+		if (nb_queues > dev_info.max_rx_queues || nb_queues > dev_info.max_tx_queues)
+			rte_exit(EXIT_FAILURE, "Port %u supports at most %u RX and %u TX queues\n",
+					(unsigned) portid, dev_info.max_rx_queues,
+					dev_info.max_tx_queues);
+		if (demu_max_frame > dev_info.max_rx_pktlen)
+			rte_exit(EXIT_FAILURE, "Port %u receives frames of at most %u bytes\n",
+					(unsigned) portid, dev_info.max_rx_pktlen);
+		/* a chain the NIC does not take would be retried forever by TX */
+		if (demu_frame_segs() > dev_info.tx_desc_lim.nb_mtu_seg_max ||
+				demu_frame_segs() > dev_info.rx_desc_lim.nb_seg_max)
+			rte_exit(EXIT_FAILURE, "Port %u takes frames of at most %u mbufs, "
+					"%u are needed for the MTU\n", (unsigned) portid,
+					RTE_MIN(dev_info.tx_desc_lim.nb_mtu_seg_max,
+						dev_info.rx_desc_lim.nb_seg_max),
+					demu_frame_segs());
+		local_port_conf.rx_adv_conf.rss_conf.rss_hf &= dev_info.flow_type_rss_offloads;
+
+		ret = rte_eth_dev_configure(portid, nb_queues, nb_queues, &local_port_conf);
 		if (ret < 0)
 			rte_exit(EXIT_FAILURE, "Cannot configure device: err=%d, port=%u\n",
 					ret, (unsigned) portid);
 
 		rte_eth_macaddr_get(portid,&demu_ports_eth_addr[portid]);
 
-		/* init one RX queue */
-		ret = rte_eth_rx_queue_setup(portid, 0, nb_rxd,
-				rte_eth_dev_socket_id(portid),
-				&rx_conf,
-				demu_pktmbuf_pool);
-		if (ret < 0)
-			rte_exit(EXIT_FAILURE, "rte_eth_rx_queue_setup:err=%d, port=%u\n",
-					ret, (unsigned) portid);
-
-		/* init one TX queue on each port */
-		ret = rte_eth_tx_queue_setup(portid, 0, nb_txd,
-				rte_eth_dev_socket_id(portid),
-				&tx_conf);
-		if (ret < 0)
-			rte_exit(EXIT_FAILURE, "rte_eth_tx_queue_setup:err=%d, port=%u\n",
-					ret, (unsigned) portid);
+		for (uint16_t q = 0; q < nb_queues; q++) {
+			/* init one RX queue per pipeline */
+			ret = rte_eth_rx_queue_setup(portid, q, nb_rxd,
+					rte_eth_dev_socket_id(portid),
+					&rx_conf,
+					demu_pktmbuf_pool[ports[i].socket]);
+			if (ret < 0)
+				rte_exit(EXIT_FAILURE, "rte_eth_rx_queue_setup:err=%d, port=%u\n",
+						ret, (unsigned) portid);
+
+			/* init one TX queue per pipeline */
+			ret = rte_eth_tx_queue_setup(portid, q, nb_txd,
+					rte_eth_dev_socket_id(portid),
+					&tx_conf);
+			if (ret < 0)
+				rte_exit(EXIT_FAILURE, "rte_eth_tx_queue_setup:err=%d, port=%u\n",
+						ret, (unsigned) portid);
+		}
 
 		/* Start device */
 		ret = rte_eth_dev_start(portid);
@@ -878,33 +6676,63 @@ main(int argc, char **argv)
 			demu_ports_eth_addr[portid].addr_bytes[4],
 			demu_ports_eth_addr[portid].addr_bytes[5]);
 
-		/* initialize port stats */
-		memset(&port_statistics, 0, sizeof(port_statistics));
-
 	}
 
 	check_all_ports_link_status(nb_ports, demu_enabled_port_mask);
 
-	char ring_name[20];
+	/* the delay line capacity of a port is shared by its pipelines */
 	for (int i = 0; i < nb_ports; i++) {
-		sprintf(ring_name, "rx_to_workers_%d", i);
-		ports[i].rx_to_workers = rte_ring_create(ring_name, DEMU_DELAYED_BUFFER_PKTS,
-			rte_socket_id(), RING_F_SP_ENQ | RING_F_SC_DEQ);
-		if (ports[i].rx_to_workers == NULL)
-			rte_exit(EXIT_FAILURE, "%s\n", rte_strerror(rte_errno));
+		for (uint16_t q = 0; q < nb_queues; q++) {
+			ports[i].rx_to_workers[q] = demu_dq_create(demu_delayed_pkts[i],
+					ports[i].socket);
+			if (ports[i].rx_to_workers[q] == NULL)
+				rte_exit(EXIT_FAILURE, "Cannot allocate ring for port %u\n",
+						ports[i].portid);
+
+			ports[i].wheel[q] = demu_wheel_create(demu_delayed_pkts[i], ports[i].socket);
+			if (ports[i].wheel[q] == NULL)
+				rte_exit(EXIT_FAILURE, "Cannot allocate delay line for port %u\n",
+						ports[i].portid);
 
-		sprintf(ring_name, "workers_to_tx_%d", i);
-		ports[i].workers_to_tx = rte_ring_create(ring_name, DEMU_SEND_BUFFER_SIZE_PKTS,
-				rte_socket_id(), RING_F_SP_ENQ | RING_F_SC_DEQ);
-		if (ports[i].workers_to_tx == NULL)
-			rte_exit(EXIT_FAILURE, "%s\n", rte_strerror(rte_errno));
+		}
 	}
 
-	for (int i = 0; i < nb_ports; i += 2) {
-		ports[i+1].workers_to_tx_other = ports[i].workers_to_tx;
-		ports[i].workers_to_tx_other = ports[i+1].workers_to_tx;
+	/*
+	 * Pipeline q of a port feeds TX queue q of its peer, or of every
+	 * other port of a switch, each through its own ring and queue in
+	 * front of the rate of the path.
+	 */
+	for (int e = 0; e < nb_ports; e++) {
+		for (int i = 0; i < nb_ports; i++) {
+			const struct demu_link *path = demu_links[i].path[e];
+
+			if (path == NULL)
+				continue;
+			ports[e].tx_src[ports[e].nb_tx_src++] = i;
+			for (uint16_t q = 0; q < nb_queues; q++) {
+				ports[e].workers_to_tx[i][q] = demu_dq_create(DEMU_SEND_BUFFER_SIZE_PKTS,
+						ports[e].socket);
+				if (ports[e].workers_to_tx[i][q] == NULL)
+					rte_exit(EXIT_FAILURE, "Cannot allocate ring for port %u\n",
+							ports[e].portid);
+
+				ports[e].bq[i][q] = demu_bq_create(demu_link_queue_nodes(path),
+						ports[e].socket);
+				if (ports[e].bq[i][q] == NULL)
+					rte_exit(EXIT_FAILURE, "Cannot allocate bottleneck queue for port %u\n",
+							ports[e].portid);
+				if (!demu_switch)
+					ports[i].workers_to_tx_other[q] = ports[e].workers_to_tx[i][q];
+			}
+		}
 	}
 
+	if (demu_ctrl_path != NULL && demu_ctrl_init(demu_ctrl_path) < 0)
+		rte_exit(EXIT_FAILURE, "Cannot open control socket %s\n", demu_ctrl_path);
+
+	if (demu_cap_path != NULL && demu_cap_open() < 0)
+		rte_exit(EXIT_FAILURE, "Cannot open capture %s\n", demu_cap_path);
+
 	ret = 0;
 	/* launch per-lcore init on every lcore */
 	rte_eal_mp_remote_launch(demu_launch_one_lcore, NULL, CALL_MASTER);
@@ -922,58 +6750,15 @@ main(int argc, char **argv)
 		RTE_LOG(INFO, DEMU, "Closing port %d\n", portid);
 		rte_eth_dev_stop(portid);
 		rte_eth_dev_close(portid);
-
-#ifdef DEBUG
-		// saketa
-		printf("Stats[%d]. TX %8" PRIu64 " RX %8" PRIu64 " rx-workDrop %" PRIu64 " work-txDrop %" PRIu64 " TXdropped %" PRIu64 "\n",
-			portid,
-			port_statistics[portid].tx,
-			port_statistics[portid].rx,
-			port_statistics[portid].rx_worker_dropped,
-			port_statistics[portid].worker_tx_dropped,
-			port_statistics[portid].dropped);
-#endif
 	}
+	demu_stats_print(stdout);
+	if (demu_gen)
+		demu_gen_print(stdout);
+	if (demu_cap_path != NULL)
+		demu_cap_close();
 
-
-
-
-#if defined(DEBUG_RX) || defined(DEBUG_TX)
-	time_t timer;
-	struct tm *timeptr;
-	timer = time(NULL);
-	timeptr = localtime(&timer);
-#endif
-#ifdef DEBUG_RX
-	char filename1[64] = {'\0'};
-	strftime(filename1, 64, "/home/aketa/result/rxtime%m%d%H%M%S", timeptr);
-	FILE *rxoutput;
-	if ((rxoutput = fopen(filename1, "a+")) == NULL) {
-		printf("file open error!!\n");
-		exit(EXIT_FAILURE);
-	}
-	for (uint64_t i = 0; i < rx_cnt - 1 ; i++) {
-		fprintf(rxoutput, "%lf\n", rx_stat[i]);
-	}
-	fclose(rxoutput);
-#endif
-#ifdef DEBUG_TX
-	char filename2[64] = {'\0'};
-	strftime(filename2, 64, "/home/aketa/result/txtime%m%d%H%M%S", timeptr);
-	FILE *txoutput;
-	if ((txoutput = fopen(filename2, "a+")) == NULL) {
-		printf("file open error!!\n");
-		exit(EXIT_FAILURE);
-	}
-	for (uint64_t i = 0; i < tx_cnt - 1 ; i++) {
-		fprintf(txoutput, "%lf\n", tx_stat[i]);
-	}
-	fclose(txoutput);
-#endif
-
-
-	/* rte_ring_dump(stdout, rx_to_workers); */
-	/* rte_ring_dump(stdout, workers_to_tx); */
+	if (demu_ctrl_path != NULL)
+		unlink(demu_ctrl_path);
 
 	RTE_LOG(INFO, DEMU, "Bye...\n");
 
@@ -987,7 +6772,7 @@ loss_random_a(double loss_rate)
 	uint64_t percent_u64;
 
 	percent = loss_rate;
-	percent *= RANDOM_MAX / 100;
+	percent = percent * RANDOM_MAX / 100;
 	percent_u64 = (uint64_t)percent;
 
 	return percent_u64;
@@ -1001,34 +6786,34 @@ loss_random(const char *loss_rate)
 
 	if (sscanf(loss_rate, "%lf", &percent) == 0)
 		return -1;
-	percent *= RANDOM_MAX / 100;
+	percent = percent * RANDOM_MAX / 100;
 	percent_u64 = (uint64_t)percent;
 
 	return percent_u64;
 }
 
 static bool
-loss_event(void)
+loss_event(struct demu_rand *rs, const struct demu_link_params *p, struct demu_link_rxq *st)
 {
 	bool lost = false;
 
-	switch (loss_mode) {
+	switch (p->loss_mode) {
 	case LOSS_MODE_NONE:
 		break;
 
 	case LOSS_MODE_RANDOM:
-		if (unlikely(loss_event_random(loss_percent_1) == true))
+		if (unlikely(loss_event_random(rs, p->loss_percent_1) == true))
 			lost = true;
 		break;
 
 	case LOSS_MODE_GE:
-		if (unlikely(loss_event_GE(loss_random_a(0), loss_random_a(100),
-			loss_percent_1, loss_percent_2) == true))
+		if (unlikely(loss_event_GE(rs, &st->ge_state, loss_random_a(0), loss_random_a(100),
+			p->loss_percent_1, p->loss_percent_2) == true))
 			lost = true;
 		break;
 
 	case LOSS_MODE_4STATE: /* FIX IT */
-		if (unlikely(loss_event_4state(loss_random_a(100), loss_random_a(0),
+		if (unlikely(loss_event_4state(rs, &st->state_4, loss_random_a(100), loss_random_a(0),
 			loss_random_a(100), loss_random_a(0), loss_random_a(1)) == true))
 			lost = true;
 		break;
@@ -1038,13 +6823,13 @@ loss_event(void)
 }
 
 static bool
-loss_event_random(uint64_t loss_rate)
+loss_event_random(struct demu_rand *rs, uint64_t loss_rate)
 {
 	bool flag = false;
 	uint64_t temp;
 
-	temp = rte_rand() % (RANDOM_MAX + 1);
-	if (loss_rate >= temp)
+	temp = demu_rand_get(rs);
+	if (temp < loss_rate)
 		flag = true;
 
 	return flag;
@@ -1056,16 +6841,15 @@ loss_event_random(uint64_t loss_rate)
  * 1: S_ABN (abnormal state, high loss ratio)
  */
 static bool
-loss_event_GE(uint64_t loss_rate_n, uint64_t loss_rate_a, uint64_t st_ch_rate_no2ab, uint64_t st_ch_rate_ab2no)
+loss_event_GE(struct demu_rand *rs, bool *state, uint64_t loss_rate_n, uint64_t loss_rate_a, uint64_t st_ch_rate_no2ab, uint64_t st_ch_rate_ab2no)
 {
 #define S_NOR 0
 #define S_ABN 1
-	static bool state = S_NOR;
 	uint64_t rnd_loss, rnd_tran;
 	uint64_t loss_rate, state_ch_rate;
 	bool flag = false;
 
-	if (state == S_NOR) {
+	if (*state == S_NOR) {
 		loss_rate = loss_rate_n;
 		state_ch_rate = st_ch_rate_no2ab;
 	} else { // S_ABN
@@ -1073,14 +6857,14 @@ loss_event_GE(uint64_t loss_rate_n, uint64_t loss_rate_a, uint64_t st_ch_rate_no
 		state_ch_rate = st_ch_rate_ab2no;
 	}
 
-	rnd_loss = rte_rand() % (RANDOM_MAX + 1);
+	rnd_loss = demu_rand_get(rs);
 	if (rnd_loss < loss_rate) {
 		flag = true;
 	}
 
-	rnd_tran = rte_rand() % (RANDOM_MAX + 1);
+	rnd_tran = demu_rand_get(rs);
 	if (rnd_tran < state_ch_rate) {
-		state = !state;
+		*state = !*state;
 	}
 
 	return flag;
@@ -1096,41 +6880,40 @@ loss_event_GE(uint64_t loss_rate_n, uint64_t loss_rate_a, uint64_t st_ch_rate_no
  * https://www.gatesair.com/documents/papers/Parikh-K130115-Network-Modeling-Revised-02-05-2015.pdf
  */
 static bool
-loss_event_4state( uint64_t p13, uint64_t p14, uint64_t p23, uint64_t p31, uint64_t p32)
+loss_event_4state(struct demu_rand *rs, char *state, uint64_t p13, uint64_t p14, uint64_t p23, uint64_t p31, uint64_t p32)
 {
-	static char state = 1;
 	bool flag = false;
-	uint64_t rnd = rte_rand() % (RANDOM_MAX + 1);
+	uint64_t rnd = demu_rand_get(rs);
 
-	switch (state) {
+	switch (*state) {
 	case 1:
 		if (rnd < p13) {
-			state = 3;
+			*state = 3;
 		} else if (rnd < p13 + p14) {
-			state = 4;
+			*state = 4;
 		}
 		break;
 
 	case 2:
 		if (rnd < p23) {
-			state = 3;
+			*state = 3;
 		}
 		break;
 
 	case 3:
 		if (rnd < p31) {
-			state = 1;
+			*state = 1;
 		} else if (rnd < p31 + p32) {
-			state = 2;
+			*state = 2;
 		}
 		break;
 
 	case 4:
-		state = 1;
+		*state = 1;
 		break;
 	}
 
-	if (state == 2 || state == 4) {
+	if (*state == 2 || *state == 4) {
 		flag = true;
 	}
 
@@ -1138,9 +6921,9 @@ loss_event_4state( uint64_t p13, uint64_t p14, uint64_t p23, uint64_t p31, uint6
 }
 
 static bool
-dup_event(void)
+dup_event(struct demu_rand *rs, uint64_t dup_rate)
 {
-	if (unlikely(loss_event_random(dup_rate) == true))
+	if (unlikely(loss_event_random(rs, dup_rate) == true))
 		return true;
 	else
 		return false;